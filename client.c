@@ -40,6 +40,40 @@ char* get_opcode_string(char opcode) {
         return "SET";
     case CMD_VERSION:
         return "VERSION";
+    case CMD_GETQ:
+        return "GETQ";
+    case CMD_NOOP:
+        return "NOOP";
+    case CMD_GETKQ:
+        return "GETKQ";
+    case CMD_SETQ:
+        return "SETQ";
+    case CMD_ADDQ:
+        return "ADDQ";
+    case CMD_DELETEQ:
+        return "DELETEQ";
+    case CMD_INCREMENT:
+        return "INCREMENT";
+    case CMD_DECREMENT:
+        return "DECREMENT";
+    case CMD_INCREMENTQ:
+        return "INCREMENTQ";
+    case CMD_DECREMENTQ:
+        return "DECREMENTQ";
+    case CMD_APPEND:
+        return "APPEND";
+    case CMD_PREPEND:
+        return "PREPEND";
+    case CMD_APPENDQ:
+        return "APPENDQ";
+    case CMD_PREPENDQ:
+        return "PREPENDQ";
+    case CMD_FLUSH:
+        return "FLUSH";
+    case CMD_FLUSHQ:
+        return "FLUSHQ";
+    case CMD_STAT:
+        return "STAT";
     default:
         return "[UNKNOWN]";
     }
@@ -55,6 +89,12 @@ char *get_status_string(uint16_t status) {
         return "ALREADY EXISTS";
     case RES_ERROR:
         return "ERROR";
+    case RES_E2BIG:
+        return "TOO LARGE";
+    case RES_NOT_STORED:
+        return "NOT STORED";
+    case RES_DELTA_BADVAL:
+        return "NOT A COUNTER";
     default:
         return "UNKNOWN";
     }
@@ -100,6 +140,60 @@ void send_request(int sock, uint8_t cmd, const uint8_t *key, const uint8_t *val,
     pthread_mutex_unlock(&pmutex);
 }
 
+/* send an INCREMENT or DECREMENT: extras of delta, initial value and an
+ * exptime of 0, all big endian
+ */
+void send_arith(int sock, uint8_t cmd, const uint8_t *key, uint16_t keylen, uint64_t delta, uint64_t initial, int thread_num) {
+    char buffer[sizeof(memcache_req_header_t) + 20] = {0};
+    memcache_req_header_t *hdr = (memcache_req_header_t *)buffer;
+    hdr->magic = 0x80;
+    hdr->opcode = cmd;
+    hdr->key_length = htons(keylen);
+    hdr->extras_length = 20;
+    hdr->total_body_length = htonl(20 + keylen);
+
+    uint8_t *extras = (uint8_t *)buffer + sizeof(memcache_req_header_t);
+    for (int i = 0; i < 8; i++) {
+        extras[7 - i] = delta >> (8 * i);
+        extras[15 - i] = initial >> (8 * i);
+    }
+
+    write(sock, buffer, sizeof(buffer));
+    write(sock, key, keylen);
+
+    pthread_mutex_lock(&pmutex);
+    printf("Thread %d; ", thread_num);
+    printf("REQUEST; Command: %s; Delta: %lu; Initial: %lu;\n", get_opcode_string(cmd), delta, initial);
+    pthread_mutex_unlock(&pmutex);
+}
+
+/* send a SET or ADD with the standard extras, flags of 0 and an exptime,
+ * and a CAS, given as the server sent it
+ */
+void send_store(int sock, uint8_t cmd, const uint8_t *key, const uint8_t *val, uint16_t keylen, uint32_t vallen,
+    uint32_t exptime, uint64_t cas, int thread_num) {
+    char buffer[sizeof(memcache_req_header_t) + 8] = {0};
+    memcache_req_header_t *hdr = (memcache_req_header_t *)buffer;
+    hdr->magic = 0x80;
+    hdr->opcode = cmd;
+    hdr->key_length = htons(keylen);
+    hdr->extras_length = 8;
+    hdr->total_body_length = htonl(8 + keylen + vallen);
+    hdr->cas = cas;
+
+    uint32_t extras[2] = { 0, htonl(exptime) };
+    memcpy(buffer + sizeof(memcache_req_header_t), extras, sizeof(extras));
+
+    write(sock, buffer, sizeof(buffer));
+    write(sock, key, keylen);
+    write(sock, val, vallen);
+
+    pthread_mutex_lock(&pmutex);
+    printf("Thread %d; ", thread_num);
+    printf("REQUEST; Command: %s; Exptime: %u; CAS set: %s;\n", get_opcode_string(cmd), exptime, cas ? "yes" : "no");
+    pthread_mutex_unlock(&pmutex);
+}
+
 /* receive a response from the server */ 
 void receive_response(int sock, memcache_req_header_t* hdr, uint8_t **key, uint8_t **value, int thread_num) {
   //    uint32_t total_body_length;
@@ -114,11 +208,14 @@ void receive_response(int sock, memcache_req_header_t* hdr, uint8_t **key, uint8
   }
     uint32_t body_len = ntohl(hdr->total_body_length);
     uint16_t key_len = ntohs(hdr->key_length);
+    uint8_t extras_len = hdr->extras_length;
     
     if (body_len > 0) {
         uint8_t *body = malloc(body_len);
-        n = read(sock, body, body_len);
-        if (n != body_len) {
+        // a large value comes in over several reads
+        uint32_t got = 0;
+        while (got < body_len && (n = read(sock, body + got, body_len - got)) > 0) got += n;
+        if (got != body_len) {
             free(body);
             pthread_mutex_lock(&pmutex);
             printf("Thread %d; ", thread_num);
@@ -126,8 +223,9 @@ void receive_response(int sock, memcache_req_header_t* hdr, uint8_t **key, uint8
             pthread_mutex_unlock(&pmutex);
             exit(-1);
         }
+        // extras, if any, come first; the caller frees the body through key
         *key = body;
-        *value = body + key_len;
+        *value = body + extras_len + key_len;
     }
 
 
@@ -149,7 +247,7 @@ void receive_response(int sock, memcache_req_header_t* hdr, uint8_t **key, uint8
         }
         printf("; ");
     }
-    uint32_t vallen = body_len - key_len;
+    uint32_t vallen = body_len - extras_len - key_len;
     if (vallen != 0) {
         printf(" Value: 0x");
         int j = 0;
@@ -193,8 +291,15 @@ void verify_correctness(int thread_num, memcache_req_header_t* hdr, memcache_req
             ntohl(exphdr->total_body_length), ntohl(hdr->total_body_length));
         exit(-1);
     }
-    if (exphdr->total_body_length != 0) {
-        if (memcmp(value, expvalue, ntohl(exphdr->total_body_length)) != 0) {
+    if (hdr->extras_length != exphdr->extras_length) {
+        printf("Thread %d; ", thread_num);
+        printf("FAILURE: Unexpected extras length. Expected: %d. Got: %d\n",
+            exphdr->extras_length, hdr->extras_length);
+        exit(-1);
+    }
+    uint32_t vallen = ntohl(exphdr->total_body_length) - exphdr->extras_length;
+    if (vallen != 0) {
+        if (memcmp(value, expvalue, vallen) != 0) {
             printf("Thread %d; ", thread_num);
             printf("FAILURE: Value does not match. Please check REQUEST and RESPONSE logs for expected and obtained value");
             exit(-1);
@@ -272,7 +377,8 @@ void* worker_thread(void *arg) {
     receive_response(sock, &hdr, &keyr, &valuer, thread_num);
     exp.opcode = CMD_GET;
     exp.vbucket_id = htons(RES_OK);
-    exp.total_body_length = htonl(vallen);
+    exp.extras_length = 4; // flags
+    exp.total_body_length = htonl(4 + vallen);
     verify_correctness(thread_num, &hdr, &exp, valuer, value);
     free((void *)keyr);
 
@@ -283,6 +389,7 @@ void* worker_thread(void *arg) {
     receive_response(sock, &hdr, &keyr, &valuer, thread_num);
     exp.opcode = CMD_SET;
     exp.vbucket_id = htons(RES_OK);
+    exp.extras_length = 0;
     exp.total_body_length = htonl(0);
     verify_correctness(thread_num, &hdr, &exp, valuer, value);
 
@@ -292,7 +399,8 @@ void* worker_thread(void *arg) {
     receive_response(sock, &hdr, &keyr, &valuer, thread_num);
     exp.opcode = CMD_GET;
     exp.vbucket_id = htons(RES_OK);
-    exp.total_body_length = htonl(vallen);
+    exp.extras_length = 4; // flags
+    exp.total_body_length = htonl(4 + vallen);
     verify_correctness(thread_num, &hdr, &exp, valuer, value);
     free((void *)keyr);
 
@@ -302,6 +410,7 @@ void* worker_thread(void *arg) {
     receive_response(sock, &hdr, &keyr, &valuer, thread_num);
     exp.opcode = CMD_DELETE;
     exp.vbucket_id = htons(RES_OK);
+    exp.extras_length = 0;
     exp.total_body_length = htonl(0);
     verify_correctness(thread_num, &hdr, &exp, valuer, value);
 
@@ -314,6 +423,16 @@ void* worker_thread(void *arg) {
     exp.total_body_length = htonl(0);
     verify_correctness(thread_num, &hdr, &exp, valuer, value);
 
+    // GETQ of a missing key stays quiet; only the NOOP answers
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_GETQ, key, NULL, keylen, 0, thread_num);
+    send_request(sock, CMD_NOOP, NULL, NULL, 0, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_NOOP;
+    exp.vbucket_id = htons(RES_OK);
+    exp.total_body_length = htonl(0);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+
     // VERSION
     keyr = NULL, valuer = NULL;
     send_request(sock, CMD_VERSION, key, NULL, keylen, 0, thread_num);
@@ -334,6 +453,142 @@ void* worker_thread(void *arg) {
     exp.total_body_length = htonl(0);
     verify_correctness(thread_num, &hdr, &exp, valuer, value);
 
+    // INCREMENT of a value that is not a number
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_SET, key, (uint8_t *)"abcdefgh", keylen, 8, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_SET;
+    exp.vbucket_id = htons(RES_OK);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_arith(sock, CMD_INCREMENT, key, keylen, 1, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_INCREMENT;
+    exp.vbucket_id = htons(RES_DELTA_BADVAL);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+
+    // INCREMENT of a value SET as decimal digits, which GET then returns
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_SET, key, (uint8_t *)"41", keylen, 2, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_SET;
+    exp.vbucket_id = htons(RES_OK);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    keyr = NULL, valuer = NULL;
+    send_arith(sock, CMD_INCREMENT, key, keylen, 1, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_INCREMENT;
+    exp.total_body_length = htonl(8);
+    verify_correctness(thread_num, &hdr, &exp, valuer, (uint8_t *)"\0\0\0\0\0\0\0\x2a");
+    free((void *)keyr);
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_GET, key, NULL, keylen, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_GET;
+    exp.extras_length = 4; // flags
+    exp.total_body_length = htonl(4 + 2);
+    verify_correctness(thread_num, &hdr, &exp, valuer, (uint8_t *)"42");
+    free((void *)keyr);
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_DELETE, key, NULL, keylen, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_DELETE;
+    exp.extras_length = 0;
+    exp.total_body_length = htonl(0);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+
+    // SET with a CAS that is not the item's fails; with its own it goes through
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_SET, key, value, keylen, vallen, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_SET;
+    exp.vbucket_id = htons(RES_OK);
+    exp.extras_length = 0;
+    exp.total_body_length = htonl(0);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    uint64_t cas = hdr.cas;
+    assert(cas != 0);
+    send_store(sock, CMD_SET, key, value, keylen, vallen, 0, ~cas, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.vbucket_id = htons(RES_EXISTS);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_store(sock, CMD_SET, key, value, keylen, vallen, 0, cas, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.vbucket_id = htons(RES_OK);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    assert(hdr.cas != cas);
+
+    // a SET with an exptime of 1 second is there until it expires
+    keyr = NULL, valuer = NULL;
+    send_store(sock, CMD_SET, key, value, keylen, vallen, 1, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_GET, key, NULL, keylen, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_GET;
+    exp.extras_length = 4; // flags
+    exp.total_body_length = htonl(4 + vallen);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    free((void *)keyr);
+    keyr = NULL, valuer = NULL;
+    sleep(2);
+    send_request(sock, CMD_GET, key, NULL, keylen, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.vbucket_id = htons(RES_NOT_FOUND);
+    exp.extras_length = 0;
+    exp.total_body_length = htonl(0);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+
+    // APPEND past the 16 KB a value chunk holds, then PREPEND and APPEND
+    // to the chunked value; every byte has to read back in place
+    uint32_t biglen = 16000 + 1000 + 2000 + 16000;
+    uint8_t *big = malloc(biglen);
+    for (uint32_t i = 0; i < biglen; i++) big[i] = (i * 7 + thread_num) % 251;
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_SET, key, big + 2000, keylen, 16000, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_SET;
+    exp.vbucket_id = htons(RES_OK);
+    exp.extras_length = 0;
+    exp.total_body_length = htonl(0);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_APPEND, key, big + 18000, keylen, 1000, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_APPEND;
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_GET, key, NULL, keylen, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_GET;
+    exp.extras_length = 4; // flags
+    exp.total_body_length = htonl(4 + 17000);
+    verify_correctness(thread_num, &hdr, &exp, valuer, big + 2000);
+    free((void *)keyr);
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_PREPEND, key, big, keylen, 2000, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_PREPEND;
+    exp.extras_length = 0;
+    exp.total_body_length = htonl(0);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_APPEND, key, big + 19000, keylen, 16000, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_APPEND;
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_GET, key, NULL, keylen, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_GET;
+    exp.extras_length = 4; // flags
+    exp.total_body_length = htonl(4 + biglen);
+    verify_correctness(thread_num, &hdr, &exp, valuer, big);
+    free((void *)keyr);
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_DELETE, key, NULL, keylen, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_DELETE;
+    exp.extras_length = 0;
+    exp.total_body_length = htonl(0);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    free(big);
+
     // OUTPUT   
     printf("sending output \n \n");
     keyr = NULL, valuer = NULL;
@@ -349,6 +604,73 @@ void* worker_thread(void *arg) {
     return NULL;
 }
 
+/* FLUSH drops every key, so it is checked on its own once the threads are
+ * done: a FLUSH keyed by a namespace has to leave the keys of another one,
+ * and a FLUSH of everything has to take those too
+ */
+void check_flush(char *server_ip, int port, int thread_num) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server = {0};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server.sin_addr);
+    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) != 0) {
+        printf("Thread %d; ", thread_num);
+        printf("FAILURE: Couldn't connect to server.\n");
+        exit(-1);
+    }
+
+    uint8_t *a = (uint8_t *)"fa:1", *b = (uint8_t *)"fb:1", *value = (uint8_t *)"flushed";
+    memcache_req_header_t hdr;
+    uint8_t *keyr = NULL, *valuer = NULL;
+    memcache_req_header_t exp = {
+        .magic = 0x81,
+        .opcode = CMD_SET,
+        .vbucket_id = htons(RES_OK),
+        .total_body_length = htonl(0),
+    };
+    send_request(sock, CMD_SET, a, value, 4, 7, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_SET, b, value, 4, 7, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+
+    // FLUSH of namespace fa
+    send_request(sock, CMD_FLUSH, (uint8_t *)"fa", NULL, 2, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_FLUSH;
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_GET, a, NULL, 4, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_GET;
+    exp.vbucket_id = htons(RES_NOT_FOUND);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_GET, b, NULL, 4, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.vbucket_id = htons(RES_OK);
+    exp.extras_length = 4; // flags
+    exp.total_body_length = htonl(4 + 7);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    free((void *)keyr);
+
+    // FLUSH of everything
+    keyr = NULL, valuer = NULL;
+    send_request(sock, CMD_FLUSH, NULL, NULL, 0, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_FLUSH;
+    exp.extras_length = 0;
+    exp.total_body_length = htonl(0);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+    send_request(sock, CMD_GET, b, NULL, 4, 0, thread_num);
+    receive_response(sock, &hdr, &keyr, &valuer, thread_num);
+    exp.opcode = CMD_GET;
+    exp.vbucket_id = htons(RES_NOT_FOUND);
+    verify_correctness(thread_num, &hdr, &exp, valuer, value);
+
+    close(sock);
+}
+
 int main(int argc, char **argv) {
     if (argc != 4) {
         printf("Usage: <command> <server_ip_address> <server_port> <number of threads>\n");
@@ -372,6 +694,7 @@ int main(int argc, char **argv) {
 
     for (int i = 0; i < num_threads; ++i)
         pthread_join(threads[i], NULL);
+    check_flush(argv[1], atoi(argv[2]), num_threads);
     clock_gettime(CLOCK_MONOTONIC, &end);
     
     elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
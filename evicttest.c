@@ -0,0 +1,138 @@
+/* test that eviction follows the value size: a server with a 2 MB limit is
+ * filled with small values, then sent larger ones (some in value chunks)
+ * and small ones again.
+ * every store has to succeed, by taking memory from the class that holds
+ * it, and the value stored last has to read back whole.
+ *
+ * usage: ./evicttest [port]
+ * runs ./mcached, so run it from the directory it was built in.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "mcached.h"
+
+#define DEFAULT_PORT 22122
+
+/* rounds of count stores of size bytes each, in order */
+static const struct {
+    int count;
+    uint32_t size;
+} rounds[] = { { 20000, 100 }, { 200, 3000 }, { 20000, 100 }, { 20, 100000 }, { 200, 3000 } };
+
+uint8_t value[100000];
+uint8_t reply[100000];
+
+int read_all(int sock, void *buf, size_t len) {
+    for (size_t got = 0; got < len;) {
+        ssize_t n = read(sock, (uint8_t *)buf + got, len - got);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+/* send one request and read its response; returns the status, or -1 if
+ * the connection failed. a value in the response is left in reply
+ */
+int request(int sock, uint8_t cmd, const char *key, const uint8_t *val, uint32_t len,
+            uint32_t *reply_len) {
+    memcache_req_header_t hdr = { 0 };
+    uint16_t keylen = strlen(key);
+    hdr.magic = 0x80;
+    hdr.opcode = cmd;
+    hdr.key_length = htons(keylen);
+    hdr.total_body_length = htonl(keylen + len);
+    // in one write, or Nagle holds the value back for the ACK of the header
+    struct iovec iov[] = { { &hdr, sizeof(hdr) }, { (char *)key, keylen }, { (uint8_t *)val, len } };
+    if (writev(sock, iov, 3) != (ssize_t)(sizeof(hdr) + keylen + len)) return -1;
+
+    if (read_all(sock, &hdr, sizeof(hdr))) return -1;
+    uint32_t body = ntohl(hdr.total_body_length);
+    uint32_t skip = hdr.extras_length + ntohs(hdr.key_length);
+    if (body < skip || body - skip > sizeof(reply)) return -1;
+    uint8_t extras[256 + 65536];
+    if (read_all(sock, extras, skip) || read_all(sock, reply, body - skip)) return -1;
+    if (reply_len) *reply_len = body - skip;
+    return ntohs(hdr.vbucket_id);
+}
+
+int connect_to(int port) {
+    struct sockaddr_in server = { 0 };
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+    // give the server a few seconds to come up
+    for (int i = 0; i < 50; i++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock, (struct sockaddr *)&server, sizeof(server)) == 0) return sock;
+        close(sock);
+        struct timespec ts = { 0, 100 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+    return -1;
+}
+
+int run(int port) {
+    int sock = connect_to(port);
+    if (sock < 0) {
+        printf("FAILURE: couldn't connect to the server\n");
+        return 1;
+    }
+
+    char key[32];
+    int failed = 0;
+    for (size_t r = 0; r < sizeof(rounds) / sizeof(rounds[0]); r++) {
+        int stored = 0;
+        for (int i = 0; i < rounds[r].count; i++) {
+            snprintf(key, sizeof(key), "r%zu-%d", r, i);
+            memset(value, 'a' + (i + r) % 26, rounds[r].size);
+            int status = request(sock, CMD_SET, key, value, rounds[r].size, NULL);
+            if (status < 0) {
+                printf("FAILURE: connection lost in round %zu\n", r);
+                return 1;
+            }
+            if (status == RES_OK) stored++;
+            else if (!failed++) printf("FAILURE: SET of %u bytes got 0x%02x\n", rounds[r].size, status);
+        }
+
+        // the last value stored is the newest, so nothing has evicted it
+        uint32_t len = 0;
+        int status = request(sock, CMD_GET, key, NULL, 0, &len);
+        int whole = status == RES_OK && len == rounds[r].size && !memcmp(reply, value, len);
+        if (!whole) failed++;
+        printf("%d of %d SETs of %u bytes stored; last one %s\n", stored, rounds[r].count,
+               rounds[r].size, whole ? "read back" : "LOST");
+    }
+    close(sock);
+    return failed != 0;
+}
+
+int main(int argc, char *argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("./mcached", "mcached", "-m", "2", port_arg, "4", (char *)NULL);
+        perror("./mcached");
+        _exit(127);
+    }
+    int rc = run(port);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    printf(rc ? "FAILED\n" : "ok\n");
+    return rc;
+}
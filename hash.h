@@ -0,0 +1,138 @@
+/* hashing and comparing keys.
+ *
+ * the key hash is picked at build time (make HASH=...): wyhash by default,
+ * hardware CRC32C on SSE4.2, or uthash's Jenkins hash as before.
+ */
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "uthash.h"
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash_jenkins(const void *key, size_t len) {
+    unsigned hashv;
+    HASH_JEN(key, len, hashv);
+    return hashv;
+}
+
+/* wyhash (final version 4), trimmed to the default secret and seed */
+static const uint64_t wy_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+};
+
+static inline void wy_mum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint32_t hash_wyhash(const void *key, size_t len) {
+    const uint8_t *p = key;
+    uint64_t seed = wy_mix(wy_secret[0], wy_secret[1]);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = (uint64_t)load32(p) << 32 | load32(p + mid);
+            b = (uint64_t)load32(p + len - 4) << 32 | load32(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(load64(p) ^ wy_secret[1], load64(p + 8) ^ seed);
+                see1 = wy_mix(load64(p + 16) ^ wy_secret[2], load64(p + 24) ^ see1);
+                see2 = wy_mix(load64(p + 32) ^ wy_secret[3], load64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mix(load64(p) ^ wy_secret[1], load64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = load64(p + i - 16);
+        b = load64(p + i - 8);
+    }
+
+    a ^= wy_secret[1];
+    b ^= seed;
+    wy_mum(&a, &b);
+    return wy_mix(a ^ wy_secret[0] ^ len, b ^ wy_secret[1]);
+}
+
+#ifdef __SSE4_2__
+/* CRC32C a word at a time. a CRC is linear in the key, so finish with
+ * murmur3's mixer: the index and the shard pick take different bits.
+ */
+static inline uint32_t hash_crc32c(const void *key, size_t len) {
+    const uint8_t *p = key;
+    uint64_t crc = ~0u;
+
+    for (; len >= 8; p += 8, len -= 8) crc = _mm_crc32_u64(crc, load64(p));
+    uint32_t h = crc;
+    if (len >= 4) {
+        h = _mm_crc32_u32(h, load32(p));
+        p += 4;
+        len -= 4;
+    }
+    while (len--) h = _mm_crc32_u8(h, *p++);
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+#endif
+
+#ifndef KEY_HASH
+#define KEY_HASH hash_wyhash
+#endif
+
+/* key equality. keys of up to 16 bytes, the common case, are compared as
+ * two overlapping words from either end instead of through memcmp.
+ */
+static inline int key_eq(const uint8_t *a, const uint8_t *b, size_t len) {
+    if (len >= 8 && len <= 16)
+        return ((load64(a) ^ load64(b)) | (load64(a + len - 8) ^ load64(b + len - 8))) == 0;
+    if (len >= 4 && len < 8)
+        return ((load32(a) ^ load32(b)) | (load32(a + len - 4) ^ load32(b + len - 4))) == 0;
+    if (len > 0 && len < 4) // first, middle and last byte cover them all
+        return ((a[0] ^ b[0]) | (a[len >> 1] ^ b[len >> 1]) | (a[len - 1] ^ b[len - 1])) == 0;
+    return memcmp(a, b, len) == 0;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/* microbenchmark for key hashing and comparison: ns per call for each
+ * hash function and for key_eq against memcmp, by key length.
+ *
+ * usage: ./hashbench [iterations]
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hash.h"
+
+#define NKEYS 1024
+#define MAX_KEY 256
+
+static const size_t lengths[] = { 1, 2, 3, 4, 6, 8, 12, 16, 20, 24, 32, 48, 64, 128, 256 };
+
+uint8_t keys[NKEYS][MAX_KEY];
+uint8_t copies[NKEYS][MAX_KEY];
+volatile uint64_t sink;
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ns per call of expr, run iters times with i counting. the functions
+ * under test inline into the loop as they do into the server.
+ */
+#define BENCH(expr, iters)                                  \
+    ({                                                      \
+        uint64_t sum = 0;                                   \
+        double start = now_ns();                            \
+        for (long i = 0; i < (iters); i++) sum += (expr);   \
+        sink += sum;                                        \
+        (now_ns() - start) / (iters);                       \
+    })
+
+#define KEY(i) keys[(i) & (NKEYS - 1)]
+#define COPY(i) copies[(i) & (NKEYS - 1)]
+
+int main(int argc, char **argv) {
+    long iters = argc > 1 ? atol(argv[1]) : 10000000;
+
+    srand(1);
+    for (int i = 0; i < NKEYS; i++)
+        for (int j = 0; j < MAX_KEY; j++) keys[i][j] = copies[i][j] = rand();
+
+    printf("%6s %10s %10s %10s %10s %10s\n", "len", "jenkins", "wyhash", "crc32c",
+           "key_eq", "memcmp");
+    for (size_t n = 0; n < sizeof(lengths) / sizeof(lengths[0]); n++) {
+        size_t len = lengths[n];
+        printf("%6zu %10.2f %10.2f", len, BENCH(hash_jenkins(KEY(i), len), iters),
+               BENCH(hash_wyhash(KEY(i), len), iters));
+#ifdef __SSE4_2__
+        printf(" %10.2f", BENCH(hash_crc32c(KEY(i), len), iters));
+#else
+        printf(" %10s", "-");
+#endif
+        // equal keys: the compare a hit pays for
+        printf(" %10.2f %10.2f\n", BENCH(key_eq(KEY(i), COPY(i), len), iters),
+               BENCH(memcmp(KEY(i), COPY(i), len) == 0, iters));
+    }
+    return 0;
+}
@@ -0,0 +1,154 @@
+/* microbenchmark for the table index: lookups per second and cache misses
+ * per lookup, for the chained index and the swiss table over the same
+ * keys, hits and misses. the index is built and searched by the server's
+ * own code, so a lookup is the one a GET makes, less hashing the key.
+ *
+ * cache misses come from the hardware counter through perf_event_open;
+ * where that is not allowed (containers, perf_event_paranoid above 2) the
+ * column reads "-", and perf stat -e cache-misses ./indexbench counts them
+ * for the whole run instead.
+ *
+ * usage: ./indexbench [lookups] [keys ...]
+ */
+
+#define main mcached_main
+#include "mcached.c"
+#undef main
+
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+
+#define KEY_LEN 16
+
+static const size_t default_sizes[] = { 10000, 100000, 1000000 };
+
+char (*keys)[KEY_LEN];  // the stored keys, then as many that are not
+uint8_t *key_lens;
+uint32_t *hashes;
+uint32_t *order;        // a random sequence of key numbers to look up
+volatile uint64_t sink;
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* a counter of this thread's cache misses in user space, or -1 */
+int perf_open(void) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_CACHE_MISSES,
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* build the index over keys 0..n-1 as stores would */
+void build(size_t n) {
+    shards_init(settings.num_shards);
+    for (size_t i = 0; i < n; i++) {
+        shard_t *sh = shard_for(hashes[i]);
+        cache_entry_t *e = entry_alloc(hashes[i], key_lens[i], sizeof(uint64_t));
+        if (!e) {
+            fprintf(stderr, "out of memory at %zu keys\n", i);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(entry_key(e), keys[i], key_lens[i]);
+        pthread_mutex_lock(&sh->lock);
+        insert_entry(sh, e);
+        pthread_mutex_unlock(&sh->lock);
+    }
+    // finish any resize, as the timer would, so lookups search one table
+    for (unsigned i = 0; i <= shard_mask; i++)
+        while (shards[i].old_table || shards[i].old_swiss) index_migrate(&shards[i], MIGRATE_IDLE_STEP);
+}
+
+/* time lookups of keys base + order[i] % n; ns per lookup and, through
+ * the counter if there is one, cache misses per lookup
+ */
+double run(size_t base, size_t n, long lookups, int perf_fd, double *misses) {
+    uint64_t found = 0;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    epoch_enter();
+    double start = now_ns();
+    for (long i = 0; i < lookups; i++) {
+        size_t k = base + order[i] % n;
+        found += lookup_entry(shard_for(hashes[k]), keys[k], key_lens[k], hashes[k]) != NULL;
+    }
+    double ns = (now_ns() - start) / lookups;
+    epoch_exit();
+    *misses = -1;
+    if (perf_fd >= 0) {
+        uint64_t count;
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &count, sizeof(count)) == sizeof(count)) *misses = (double)count / lookups;
+    }
+    sink += found;
+    return ns;
+}
+
+void print_misses(double misses) {
+    if (misses < 0) printf(" %12s", "-");
+    else printf(" %12.2f", misses);
+}
+
+int main(int argc, char **argv) {
+    long lookups = argc > 1 ? atol(argv[1]) : 10000000;
+    size_t nsizes = argc > 2 ? (size_t)argc - 2 : sizeof(default_sizes) / sizeof(default_sizes[0]);
+    size_t sizes[nsizes];
+    size_t most = 0;
+    for (size_t i = 0; i < nsizes; i++) {
+        sizes[i] = argc > 2 ? strtoul(argv[i + 2], NULL, 10) : default_sizes[i];
+        if (sizes[i] == 0 || lookups <= 0) {
+            fprintf(stderr, "usage: %s [lookups] [keys ...]\n", argv[0]);
+            return 1;
+        }
+        if (sizes[i] > most) most = sizes[i];
+    }
+
+    keys = malloc(2 * most * KEY_LEN);
+    key_lens = malloc(2 * most);
+    hashes = malloc(2 * most * sizeof(uint32_t));
+    order = malloc(lookups * sizeof(uint32_t));
+    if (!keys || !key_lens || !hashes || !order) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < 2 * most; i++) {
+        key_lens[i] = snprintf(keys[i], KEY_LEN, i < most ? "key:%zu" : "miss:%zu", i);
+        hashes[i] = key_hash(keys[i], key_lens[i]);
+    }
+    srand(1);
+    for (long i = 0; i < lookups; i++) order[i] = ((uint32_t)rand() << 16) ^ rand();
+
+    slabs_init();
+    evict_init();
+    epoch_register();
+    int perf_fd = perf_open();
+
+    printf("%10s %6s %10s %12s %10s %12s\n", "keys", "index", "Mhits/s", "misses/hit",
+           "Mmisses/s", "misses/miss");
+    for (size_t s = 0; s < nsizes; s++) {
+        for (int index = INDEX_CHAIN; index <= INDEX_SWISS; index++) {
+            settings.index = index;
+            build(sizes[s]);
+            double hit_misses, miss_misses;
+            double hit_ns = run(0, sizes[s], lookups, perf_fd, &hit_misses);
+            double miss_ns = run(most, sizes[s], lookups, perf_fd, &miss_misses);
+            printf("%10zu %6s %10.2f", sizes[s], index == INDEX_SWISS ? "swiss" : "chain",
+                   1e3 / hit_ns);
+            print_misses(hit_misses);
+            printf(" %10.2f", 1e3 / miss_ns);
+            print_misses(miss_misses);
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,311 @@
+/* load generator: starts ./mcached with the options given after --, drives
+ * it from several connections for a while, and prints the requests per
+ * second it answered and the share of GETs that hit.
+ *
+ * every connection sends batches of GETs and SETs in one write and reads
+ * the answers back. a GET that misses is followed by a SET of its key in
+ * the next batch, as a cache in front of a slower store would do. keys are
+ * picked uniformly or, with -z, from a Zipf distribution over their rank.
+ *
+ * usage: ./loadbench [-c conns] [-t secs] [-w warmup secs] [-k keys]
+ *                    [-v value bytes] [-g get percent] [-z skew]
+ *                    [-b batch] [-n server threads] [-p port] [-P]
+ *                    [-- server options]
+ * -P stores every key before the clock starts. the server gets as many
+ * threads as there are connections unless -n says otherwise; the blocking
+ * model needs at least that many. runs ./mcached, so run it from the
+ * directory it was built in.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+
+#include "mcached.h"
+
+#define HDR_SIZE sizeof(memcache_req_header_t)
+#define MAX_BATCH 256
+#define KEY_MAX 24
+#define VALUE_MAX 65536
+#define RBUF_SIZE (1 << 20)
+
+struct {
+    int conns;
+    int secs;
+    int warmup;
+    uint32_t keys;
+    uint32_t value_size;
+    int get_pct;
+    double skew;
+    int batch;
+    int server_threads;
+    int port;
+    int prefill;
+} opts = { 8, 5, 1, 100000, 100, 90, 0, 16, 0, 22123, 0 };
+
+double *zipf_cdf; // cumulative probability by key rank, NULL if uniform
+uint8_t *value;
+volatile int running = 1;
+volatile int counting = 0;
+
+struct conn {
+    pthread_t thread;
+    int sock;
+    uint64_t seed;
+    uint64_t ops, gets, hits;
+    // misses to fill first in the next batch
+    uint32_t fill[MAX_BATCH];
+    int nfill;
+    // response bytes read but not yet parsed
+    uint8_t *rbuf;
+    size_t rpos, rlen;
+};
+
+uint64_t next_random(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+uint32_t pick_key(struct conn *c) {
+    uint64_t r = next_random(&c->seed);
+    if (!zipf_cdf) return r % opts.keys;
+    double u = (r >> 11) * (1.0 / (1ULL << 53));
+    uint32_t lo = 0, hi = opts.keys - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void zipf_init(void) {
+    zipf_cdf = malloc(opts.keys * sizeof(double));
+    double sum = 0;
+    for (uint32_t i = 0; i < opts.keys; i++) {
+        sum += 1.0 / pow(i + 1, opts.skew);
+        zipf_cdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < opts.keys; i++) zipf_cdf[i] /= sum;
+}
+
+/* append a GET or SET of key to the batch in buf; returns its length */
+size_t put_request(uint8_t *buf, uint8_t cmd, uint32_t key) {
+    memcache_req_header_t *hdr = (memcache_req_header_t *)buf;
+    char *k = (char *)buf + HDR_SIZE;
+    int keylen = snprintf(k, KEY_MAX, "key:%u", key);
+    uint32_t len = cmd == CMD_SET ? opts.value_size : 0;
+    memset(hdr, 0, HDR_SIZE);
+    hdr->magic = 0x80;
+    hdr->opcode = cmd;
+    hdr->key_length = htons(keylen);
+    hdr->total_body_length = htonl(keylen + len);
+    if (len) memcpy(k + keylen, value, len);
+    return HDR_SIZE + keylen + len;
+}
+
+/* n bytes of response at c->rbuf + c->rpos, reading more as needed */
+int need(struct conn *c, size_t n) {
+    if (c->rlen - c->rpos >= n) return 0;
+    memmove(c->rbuf, c->rbuf + c->rpos, c->rlen - c->rpos);
+    c->rlen -= c->rpos;
+    c->rpos = 0;
+    while (c->rlen < n) {
+        ssize_t got = read(c->sock, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+        if (got <= 0) return -1;
+        c->rlen += got;
+    }
+    return 0;
+}
+
+/* status of the next response, its body skipped */
+int get_response(struct conn *c) {
+    if (need(c, HDR_SIZE)) return -1;
+    memcache_req_header_t *hdr = (memcache_req_header_t *)(c->rbuf + c->rpos);
+    uint32_t body = ntohl(hdr->total_body_length);
+    int status = ntohs(hdr->vbucket_id);
+    if (HDR_SIZE + body > RBUF_SIZE || need(c, HDR_SIZE + body)) return -1;
+    c->rpos += HDR_SIZE + body;
+    return status;
+}
+
+int batch(struct conn *c, uint8_t *buf) {
+    uint8_t cmds[MAX_BATCH];
+    uint32_t keys[MAX_BATCH];
+    size_t len = 0;
+    int n = 0;
+    for (int i = 0; i < c->nfill; i++, n++) {
+        cmds[n] = CMD_SET;
+        keys[n] = c->fill[i];
+    }
+    c->nfill = 0;
+    for (; n < opts.batch; n++) {
+        keys[n] = pick_key(c);
+        cmds[n] = (int)(next_random(&c->seed) % 100) < opts.get_pct ? CMD_GET : CMD_SET;
+    }
+    for (int i = 0; i < n; i++) len += put_request(buf + len, cmds[i], keys[i]);
+    for (size_t off = 0; off < len;) {
+        ssize_t put = write(c->sock, buf + off, len - off);
+        if (put <= 0) return -1;
+        off += put;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int status = get_response(c);
+        if (status < 0) return -1;
+        if (cmds[i] != CMD_GET) continue;
+        if (status == RES_OK) c->hits += counting;
+        else c->fill[c->nfill++] = keys[i];
+        c->gets += counting;
+    }
+    c->ops += counting ? n : 0;
+    return 0;
+}
+
+int connect_to(int port) {
+    struct sockaddr_in server = { 0 };
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+    // give the server a few seconds to come up
+    for (int i = 0; i < 50; i++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock, (struct sockaddr *)&server, sizeof(server)) == 0) return sock;
+        close(sock);
+        struct timespec ts = { 0, 100 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+    return -1;
+}
+
+void *conn_thread(void *arg) {
+    struct conn *c = arg;
+    uint8_t *buf = malloc(opts.batch * (HDR_SIZE + KEY_MAX + opts.value_size));
+    while (running)
+        if (batch(c, buf)) {
+            fprintf(stderr, "connection lost\n");
+            exit(EXIT_FAILURE);
+        }
+    free(buf);
+    return NULL;
+}
+
+/* store every key, spread over the connections, before timing anything */
+void prefill(struct conn *conns) {
+    uint8_t *buf = malloc(opts.batch * (HDR_SIZE + KEY_MAX + opts.value_size));
+    for (uint32_t key = 0; key < opts.keys;) {
+        struct conn *c = &conns[key / opts.batch % opts.conns];
+        size_t len = 0;
+        int n = 0;
+        for (; n < opts.batch && key < opts.keys; n++, key++) len += put_request(buf + len, CMD_SET, key);
+        if (write(c->sock, buf, len) != (ssize_t)len) exit(EXIT_FAILURE);
+        while (n--)
+            if (get_response(c) < 0) exit(EXIT_FAILURE);
+    }
+    free(buf);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c conns] [-t secs] [-w warmup secs] [-k keys] [-v value bytes]\n"
+            "       [-g get percent] [-z skew] [-b batch] [-n server threads] [-p port] [-P]\n"
+            "       [-- server options]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:w:k:v:g:z:b:n:p:P")) != -1) {
+        switch (opt) {
+            case 'c': opts.conns = atoi(optarg); break;
+            case 't': opts.secs = atoi(optarg); break;
+            case 'w': opts.warmup = atoi(optarg); break;
+            case 'k': opts.keys = strtoul(optarg, NULL, 10); break;
+            case 'v': opts.value_size = strtoul(optarg, NULL, 10); break;
+            case 'g': opts.get_pct = atoi(optarg); break;
+            case 'z': opts.skew = atof(optarg); break;
+            case 'b': opts.batch = atoi(optarg); break;
+            case 'n': opts.server_threads = atoi(optarg); break;
+            case 'p': opts.port = atoi(optarg); break;
+            case 'P': opts.prefill = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (!opts.server_threads) opts.server_threads = opts.conns;
+    if (opts.conns <= 0 || opts.server_threads < 0 || opts.secs <= 0 || opts.warmup < 0 || !opts.keys || opts.batch <= 0 ||
+        opts.batch > MAX_BATCH || opts.get_pct < 0 || opts.get_pct > 100 ||
+        opts.value_size > VALUE_MAX)
+        usage(argv[0]);
+
+    // ./mcached [server options] <port> <threads>
+    char port_arg[16], threads_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", opts.port);
+    snprintf(threads_arg, sizeof(threads_arg), "%d", opts.server_threads);
+    char **server_argv = calloc(argc - optind + 4, sizeof(char *));
+    int n = 0;
+    server_argv[n++] = "mcached";
+    for (int i = optind; i < argc; i++) server_argv[n++] = argv[i];
+    server_argv[n++] = port_arg;
+    server_argv[n++] = threads_arg;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv("./mcached", server_argv);
+        perror("./mcached");
+        _exit(127);
+    }
+
+    if (opts.skew > 0) zipf_init();
+    value = malloc(opts.value_size);
+    memset(value, 'v', opts.value_size);
+    struct conn *conns = calloc(opts.conns, sizeof(struct conn));
+    for (int i = 0; i < opts.conns; i++) {
+        conns[i].sock = connect_to(opts.port);
+        if (conns[i].sock < 0) {
+            fprintf(stderr, "couldn't connect to the server\n");
+            kill(pid, SIGTERM);
+            return EXIT_FAILURE;
+        }
+        conns[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        conns[i].rbuf = malloc(RBUF_SIZE);
+    }
+    if (opts.prefill) prefill(conns);
+
+    for (int i = 0; i < opts.conns; i++) pthread_create(&conns[i].thread, NULL, conn_thread, &conns[i]);
+    sleep(opts.warmup);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    counting = 1;
+    sleep(opts.secs);
+    counting = 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    running = 0;
+    uint64_t ops = 0, gets = 0, hits = 0;
+    for (int i = 0; i < opts.conns; i++) {
+        pthread_join(conns[i].thread, NULL);
+        ops += conns[i].ops;
+        gets += conns[i].gets;
+        hits += conns[i].hits;
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("mcached");
+    for (int i = 1; i < n - 2; i++) printf(" %s", server_argv[i]);
+    printf(": %.0f requests/s, %.2f%% of GETs hit\n", ops / secs, gets ? 100.0 * hits / gets : 0);
+    return 0;
+}
@@ -1,289 +1,4189 @@
-#define _POSIX_C_SOURCE 199309L
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <linux/errqueue.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#include "uthash.h"
+#include "hash.h"
 #include "mcached.h"
 
 #define PORT 11211
 #define MAX_THREADS 128
-#define BACKLOG 10
+#define BACKLOG 1024
+#define NUM_SHARDS 64
+#define MAX_SHARDS 65536 // shard_for picks from 16 bits of the hash
+#define SHARD_BUCKETS 16
 
+/* an item: header, key and value in one slab chunk. what a GET reads sits
+ * in the header bytes just before the key. entries are never changed once
+ * linked into the table, bar a counter's value and CAS; a SET links a new
+ * one in place of the old, so GETs read them without taking any lock. the
+ * table holds one reference; a GET that hands the value to the kernel
+ * instead of copying it holds another until the kernel is done with it.
+ */
 typedef struct cache_entry {
-    char *key;
-    void *value;
-    size_t key_len; 
-    size_t value_len;
-    pthread_mutex_t lock;
-    UT_hash_handle hh;
+    // only writers, under the shard lock, use these
+    struct cache_entry *eprev, *enext;   // eviction list
+    struct cache_entry *tnext, **tpprev; // timer wheel slot, if it expires
+    int refcount;
+    uint8_t slab_class;         // 0 if too big for a slab and malloc'd
+    uint8_t seg;                // eviction list it is on
+    // what a GET reads, packed up against the key it reads next
+    uint8_t hits;               // since the eviction policy last looked
+    uint8_t chunked;            // value is a vchunks_t, not the bytes
+    uint32_t atime;             // last hit counted, for -e lru
+    uint32_t hv;
+    struct cache_entry *next;   // hash chain, or slab free list
+    uint64_t cas;               // set when linked in
+    uint32_t flags;             // opaque to us, echoed on GET
+    uint32_t exptime;           // in current_secs(), 0 = never
+    uint32_t len;               // of the value; as wide as the protocol's body length
+    uint32_t gen;               // entry_gen() when linked in; dead once that moves on
+    uint16_t ns;                // namespace slot of the key
+    uint16_t key_len;           // as wide as the protocol's
+    uint8_t counter;            // COUNTER_TEXT or COUNTER_WORD, 0 if not one
+    uint8_t data[];             // key, then value
 } cache_entry_t;
 
-cache_entry_t *cache_table = NULL;
-pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
-int server_fd;
+/* bytes of an item before its key; sizeof would round this up */
+#define ENTRY_HDR offsetof(cache_entry_t, data)
+
+/* where the value starts, past the key: 8-aligned within the chunk, so a
+ * counter can be updated with one atomic store
+ */
+static inline size_t entry_value_off(size_t key_len) {
+    return ((ENTRY_HDR + key_len + 7) & ~(size_t)7) - ENTRY_HDR;
+}
+
+static inline size_t entry_size(size_t key_len, size_t len) {
+    return ENTRY_HDR + entry_value_off(key_len) + len;
+}
+
+/* a value chunk: one slab chunk of the value chunk class, which holds
+ * nothing else. owner is the item it was linked into last, for draining
+ */
+typedef struct vchunk {
+    struct vchunk *next;
+    struct cache_entry *owner;
+    uint8_t data[];
+} vchunk_t;
+
+/* the value of a chunked item, in place of its bytes: a list of value
+ * chunks, each full but the first, whose bytes start at head_off, and the
+ * last. APPEND fills the last and links more behind it; PREPEND fills the
+ * first from the back and links more in front. so the bytes a reader has
+ * seen never change, and entry->len and the head are all it has to read.
+ */
+typedef struct vchunks {
+    uint32_t seq;       // odd while PREPEND moves head and head_off
+    uint32_t head_off;
+    vchunk_t *head;
+    vchunk_t *tail;     // writers only
+    uint32_t tail_used; // writers only
+} vchunks_t;
+
+/* per-connection read buffer; bodies larger than this grow it on demand */
+#define RBUF_SIZE 16384
+#define WBUF_HIGHWAT (1 << 20) // stop parsing and flush past this much output
+#define MAX_EVENTS 256
+#define REF_MIN 4096           // values this big are referenced, not copied
+#define VCHUNK_SIZE 16384      // about what a value chunk takes; 64 fit a slab page
+#define CHUNKED_MIN 65536      // stored values past this are split into value chunks
+#define ITEM_MAX (1 << 20)     // default largest value stored
+#define ZEROCOPY_MIN 65536     // default size for MSG_ZEROCOPY sends
+#define HOT_COPIES 64          // default private copies of hot items per worker
+#define MAX_HOT_COPIES 65536
+#define MAX_IOV 64
+
+enum index_kind {
+    INDEX_CHAIN,
+    INDEX_SWISS,
+};
+
+enum evict_kind {
+    EVICT_LRU,
+    EVICT_CLOCK,
+    EVICT_S3FIFO,
+    EVICT_TINYLFU,
+};
+
+enum io_model {
+    IO_BLOCKING, // one blocking connection per worker thread
+    IO_EPOLL,    // non-blocking epoll event loop per worker thread
+    IO_URING,    // io_uring completion loop per worker thread
+};
+
+enum conn_state {
+    CONN_READ,  // waiting for (more) request bytes
+    CONN_WRITE, // output is backlogged, waiting for the socket to drain
+    CONN_CLOSE, // peer went away or the stream is corrupt
+};
+
+typedef struct conn {
+    int fd;
+    enum io_model io; // how conn_write may touch the socket
+    enum conn_state state;
+    uint8_t *rbuf;
+    size_t rsize;  // capacity of rbuf
+    size_t rbytes; // bytes currently buffered
+    // a store whose value is being received straight into its entry
+    memcache_req_header_t nhdr;
+    cache_entry_t *nvalue;
+    size_t nvalue_got;
+    size_t nskip;  // body bytes of a rejected frame still to throw away
+    uint8_t *wbuf; // response bytes the socket has not accepted yet
+    size_t wsize;
+    size_t wbytes;
+    size_t wcurr;  // bytes of wbuf already sent
+    // values queued by reference between wbuf bytes, in output order
+    struct out_ref *refs;
+    int nrefs;
+    int refs_size;
+    int rcurr;     // first ref not fully sent
+    size_t rsent;  // bytes of refs[rcurr] already sent
+    // MSG_ZEROCOPY sends the kernel has not released yet
+    int zerocopy;  // SO_ZEROCOPY is enabled on the socket
+    uint32_t zc_next;
+    struct zc_pending *zc;
+    int zc_head;
+    int nzc;
+    int zc_size;
+    // io_uring only: wbuf is swapped in here while the kernel sends it
+    uint8_t *sbuf;
+    size_t ssize;
+    size_t sbytes;
+    size_t scurr;
+    int inflight; // submitted operations that still owe a completion
+    int recv_armed;
+    int recv_cancel; // a cancel of the armed recv is on its way
+    int recv_paused; // held back frames fill rbuf; don't read more
+    int shutdown_sent;
+    int dirty;    // queued on the worker's flush list
+    struct conn *next_dirty;
+    // closed, but kept until the kernel is done with its zerocopy sends
+    int parked;
+    struct conn *next_parked;
+} conn_t;
+
+typedef struct out_ref {
+    size_t at;          // wbuf offset the value goes out behind
+    cache_entry_t *val;
+    uint32_t len;       // of the value when queued; APPEND may have grown it
+    uint32_t off;       // chunked values: where the unsent rest starts, as
+    vchunk_t *chunk;    // a chunk and an offset into it
+} out_ref_t;
+
+typedef struct zc_pending {
+    uint32_t id;        // the kernel's per-socket zerocopy send counter
+    cache_entry_t *val;
+} zc_pending_t;
+
+typedef struct worker {
+    int id;
+    pthread_t thread;
+    int listen_fd; // the shared listener, or this worker's own SO_REUSEPORT one
+    int cpu;       // CPU the worker is pinned to, or -1
+    unsigned node; // -N: NUMA node it runs on, as an index into node_ids
+    int epfd;
+    uint8_t *spare_rbuf; // read buffer lent to whichever connection reads next
+    struct uring *ring;
+    struct conn *parked; // closed connections with zerocopy sends pending
+} worker_t;
+
+struct settings {
+    int port;
+    int num_threads;
+    enum io_model io_model;
+    int backlog;
+    int reuseport; // one SO_REUSEPORT listener per worker
+    int pin_cpus;  // pin worker i to the i-th CPU we may run on
+    int numa;      // place shards and workers on NUMA nodes
+    size_t zerocopy_min; // values at least this big use MSG_ZEROCOPY; 0 = never
+    size_t mem_limit;    // bytes of item memory, 0 = unlimited
+    size_t item_max;     // largest value accepted
+    unsigned hot_copies; // per worker, 0 = none
+    unsigned num_shards; // power of two
+    enum index_kind index;
+    enum evict_kind evict;
+} settings = {
+    .num_shards = NUM_SHARDS,
+    .zerocopy_min = ZEROCOPY_MIN,
+    .item_max = ITEM_MAX,
+    .hot_copies = HOT_COPIES,
+    .port = PORT,
+    .num_threads = 4,
+    .io_model = IO_BLOCKING,
+    .backlog = BACKLOG,
+};
+
+/* bucket array of a shard. lock-free readers may be walking it, so a
+ * resize publishes a new one next to it and moves the chains over a few
+ * buckets at a time; until it is done lookups search both.
+ */
+typedef struct table {
+    size_t mask;
+    cache_entry_t *buckets[];
+} table_t;
+
+#define GROUP_SIZE 16
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
+/* chain relinking is guarded per stripe of buckets, by the low bits of the
+ * hash: an old bucket and the two new ones it splits into share them, so
+ * a step of a resize only makes misses in the stripes it moves retry
+ */
+#define CHAIN_SEQS 16 // at most SHARD_BUCKETS
+
+#define MIGRATE_STEP 4         // old buckets (or groups) moved per insert
+#define MIGRATE_IDLE_STEP 1024 // and per timer tick, so idle shards finish
+
+typedef struct swiss_slot {
+    cache_entry_t *entry;
+    uint32_t hv;
+} swiss_slot_t;
+
+/* swiss index of a shard: one control byte per slot, then the slots */
+typedef struct swiss {
+    size_t mask;    // groups - 1
+    size_t used;    // slots that are not EMPTY, tombstones included
+    uint8_t *ctrl;
+    swiss_slot_t *slots;
+} swiss_t;
+
+/* slab allocator. entries are carved from 1 MB pages cut into chunks of
+ * geometrically growing size classes, so a SET only calls into the system
+ * allocator when a class runs dry, and the waste per entry is bounded by
+ * the class spacing. a chunk given back goes on a free list of the shard
+ * its item hashed to, under the shard's slab lock, and that shard's stores
+ * take from there first; only what overflows it goes back to the page,
+ * under the lock of the class. pages are shared by all shards: per-shard
+ * pages would need shards x classes megabytes before a memory limit let
+ * anything be cached. for the same reason a shard keeps no more than a
+ * 64th of a page's chunks free, so together they hold on to about a page
+ * of each class at the default shard count.
+ */
+#define SLAB_PAGE_SIZE (1 << 20)
+#define SLAB_PAGE_HDR 64        // slab_page_t, at the start of each page
+#define SLAB_MIN 64
+#define SLAB_FACTOR 1.25
+#define MAX_SLAB_CLASSES 64
+#define SHARD_FREE_MAX 64       // free chunks a shard keeps per class, at most
+#define SLAB_DRAIN_MAX 8        // pages being drained at once, per node
+
+/* the head of a slab page. pages are aligned to their size, so a chunk
+ * finds its page by masking. a page a class gives up is drained: every
+ * item on it is evicted, and once all of its chunks are back it goes to
+ * its node's pool of empty pages, for any class to take.
+ */
+typedef struct slab_page {
+    struct slab_page *next;     // in its class's pages, or in the pool
+    struct slab_page *pnext;    // in its class's pages with free chunks
+    struct slab_page *dnext;    // in its node's pages being drained
+    void *free;                 // chunks given back to the page itself
+    uint32_t nfree;             // those, and the ones not carved yet
+    uint32_t carved;
+    uint8_t cls;
+    uint8_t partial;            // on pnext
+    uint8_t draining;
+    uint8_t pins;               // walks of it under way; node lock
+} slab_page_t;
+
+/* eviction lists, one set per shard and slab class so an eviction frees
+ * a chunk the allocation can use. what each list means is up to the
+ * policy; all of them are only rearranged by writers under the shard lock.
+ */
+#define EVICT_SEGS 3
+#define EVICT_TRIES 16
+
+typedef struct evict_lists {
+    cache_entry_t *head[EVICT_SEGS];
+    cache_entry_t *tail[EVICT_SEGS];
+    size_t count[EVICT_SEGS];
+    cache_entry_t *hand;    // -e clock
+} evict_lists_t;
+
+struct sketch;
+
+/* expiry timer wheel, one per shard: WHEEL_LEVELS rings of WHEEL_SLOTS
+ * one-second slots, each level's slot spanning a whole turn of the level
+ * below. an entry sits in the slot its expiry time falls in at the
+ * coarsest level that still has to resolve it, and moves down a level
+ * whenever the ring below wraps around to its slot. adding, removing and
+ * expiring an entry is O(1); a tick only looks at the slots it passes.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel {
+    uint32_t now;   // last second expired
+    cache_entry_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+typedef struct slab_class {
+    pthread_mutex_t lock;
+    slab_page_t *pages;     // all it holds but those being drained
+    slab_page_t *partial;   // of those, the ones with chunks free
+    size_t npages;
+} __attribute__((aligned(64))) slab_class_t;
+
+typedef struct slab_node {
+    pthread_mutex_t lock;
+    slab_page_t *pool;      // empty, and given back to the kernel
+    slab_page_t *draining;
+    unsigned ndraining;
+} __attribute__((aligned(64))) slab_node_t;
+
+/* the table is split into independently locked shards picked by key hash,
+ * so operations on different keys rarely contend. the fields lookups read
+ * sit on a different cache line from the ones writers keep dirtying.
+ */
+typedef struct shard {
+    table_t *table;     // -x chain
+    table_t *old_table; // being moved into table, or NULL
+    swiss_t *swiss;     // -x swiss
+    swiss_t *old_swiss; // being moved into swiss, or NULL
+    unsigned seq[CHAIN_SEQS]; // odd while a resize relinks chains of that stripe
+    pthread_mutex_t lock __attribute__((aligned(64)));
+    size_t count;
+    size_t migrated;        // buckets or groups of the old index moved so far
+    uint64_t cas_seq;       // under lock
+    evict_lists_t lists[MAX_SLAB_CLASSES]; // under lock
+    uint32_t *ghost;        // -e s3fifo
+    struct sketch *sketch;  // -e tinylfu
+    wheel_t wheel;          // under lock
+    uint32_t crawled;       // flush_seq the crawler last finished a pass for
+    uint32_t crawl_seq;     // and the one the pass under way started at
+    size_t crawl_pos;       // bucket or slot it is at
+    void *crawl_index;      // and of which table; a resize restarts it
+    unsigned node;          // NUMA node its items live on
+    pthread_mutex_t slab_lock __attribute__((aligned(64)));
+    void *free[MAX_SLAB_CLASSES];       // chunks, linked through their first word
+    uint8_t nfree[MAX_SLAB_CLASSES];
+} __attribute__((aligned(64))) shard_t;
+
+/* an eviction policy. touch() runs on the lock-free GET path and may only
+ * write to the entry; insert() and victim() run under the shard lock.
+ * victim() picks what to evict but leaves the unlinking to the caller.
+ */
+typedef struct evict_policy {
+    const char *name;
+    void (*touch)(cache_entry_t *entry);
+    void (*insert)(shard_t *sh, evict_lists_t *l, cache_entry_t *entry);
+    cache_entry_t *(*victim)(shard_t *sh, evict_lists_t *l);
+} evict_policy_t;
+
+/* epoch-based reclamation. a reader announces the global epoch it saw for
+ * as long as it may hold pointers into the table, and clears it when done.
+ * writers park whatever they unlink on a per-thread list tagged with the
+ * epoch of the moment. the epoch only moves once every active reader has
+ * caught up with it, so anything retired two epochs back is unreachable.
+ * a worker frees its own list between batches; the timer thread frees it
+ * for workers that went idle and stopped doing so.
+ */
+typedef struct retired {
+    void *p;
+    void (*fn)(void *);
+    uint64_t epoch;
+} retired_t;
+
+typedef struct epoch_rec {
+    uint64_t active;    // epoch being read in, 0 when quiescent
+    struct epoch_rec *next;
+    pthread_mutex_t lock; // limbo: the owner's, or the timer thread's while it helps
+    retired_t *limbo;   // oldest first
+    size_t nlimbo, limbo_size;
+} __attribute__((aligned(64))) epoch_rec_t;
+
+uint64_t global_epoch __attribute__((aligned(64))) = 1;
+epoch_rec_t *epoch_recs;
+pthread_mutex_t epoch_recs_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread epoch_rec_t *my_epoch;
+
+shard_t *shards;
+unsigned shard_mask;
+unsigned shard_bits;
+int server_fd = -1;
+
+static inline uint32_t key_hash(const void *key, size_t key_len) {
+    return KEY_HASH(key, key_len);
+}
+
+uint32_t current_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/* the bucket arrays index on the low bits of the hash, so pick the shard from a
+ * multiplicative remix of all of them to keep the two independent.
+ */
+shard_t *shard_for(uint32_t hv) {
+    return &shards[(uint32_t)(hv * 2654435769u) >> 16 & shard_mask];
+}
+
+/* -N: NUMA nodes with CPUs we may run on, by index. shards are split
+ * into a contiguous run per node; the slab pages of a shard's items come
+ * from its node's classes and are placed on that node, and every worker
+ * runs on the CPUs of one node, taking them in turn. without -N all of
+ * this is node 0.
+ */
+#define MAX_NODES 8
+
+unsigned num_nodes = 1;
+int node_ids[MAX_NODES];        // the kernel's number for each
+cpu_set_t node_cpus[MAX_NODES];
+
+/* GET counters of a worker, added up by node for STAT */
+typedef struct worker_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t remote;    // of both, for items on another node
+    unsigned node;
+} __attribute__((aligned(64))) worker_stats_t;
+
+worker_stats_t worker_stats[MAX_THREADS];
+__thread worker_stats_t *my_stats;
+
+/* only the worker itself writes its counters */
+static inline void stat_bump(uint64_t *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/* cpu_set of a sysfs cpulist such as "0-3,8-11" */
+void parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list) {
+        char *end;
+        long lo = strtol(list, &end, 10), hi = lo;
+        if (end == list) break;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        for (long cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, set);
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* find the nodes with CPUs in allowed. without any, stay on one node */
+void numa_init(const cpu_set_t *allowed) {
+    unsigned n = 0;
+    for (int id = 0; id < 64 && n < MAX_NODES; id++) {
+        char path[64], list[1024];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        if (!fgets(list, sizeof(list), f)) list[0] = 0;
+        fclose(f);
+
+        cpu_set_t cpus;
+        parse_cpulist(list, &cpus);
+        CPU_AND(&cpus, &cpus, allowed);
+        if (!CPU_COUNT(&cpus)) continue;
+        node_ids[n] = id;
+        node_cpus[n++] = cpus;
+    }
+    if (n) num_nodes = n;
+}
+
+slab_class_t slabs[MAX_NODES][MAX_SLAB_CLASSES];
+slab_node_t slab_nodes[MAX_NODES];
+size_t slab_size[MAX_SLAB_CLASSES];   // chunk size of each class
+unsigned shard_free_max[MAX_SLAB_CLASSES]; // free chunks of it a shard keeps
+unsigned num_slab_classes;
+unsigned vchunk_class;  // the last class, for value chunks only
+size_t vchunk_cap;      // and the value bytes each holds
+size_t mem_used;    // slab pages plus items too big for a slab
+
+/* account for size more bytes of item memory, unless that breaks the limit */
+int mem_reserve(size_t size) {
+    size_t used = __atomic_add_fetch(&mem_used, size, __ATOMIC_RELAXED);
+    if (settings.mem_limit && used > settings.mem_limit) {
+        __atomic_sub_fetch(&mem_used, size, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+/* smallest class whose chunks fit an item of size bytes, 0 if none does */
+unsigned slab_class_for(size_t size) {
+    unsigned lo = 1, hi = vchunk_class - 1;
+    if (size > slab_size[hi]) return 0;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (slab_size[mid] < size) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void slabs_init(void) {
+    size_t size = SLAB_MIN;
+    unsigned n = 1;
+    while (n < MAX_SLAB_CLASSES - 2 && size <= SLAB_PAGE_SIZE / 2) {
+        slab_size[n++] = size;
+        size = (size_t)(size * SLAB_FACTOR + 7) & ~(size_t)7;
+    }
+    slab_size[n++] = SLAB_PAGE_SIZE - SLAB_PAGE_HDR;
+    vchunk_class = n;
+    slab_size[n++] = ((SLAB_PAGE_SIZE - SLAB_PAGE_HDR) / (SLAB_PAGE_SIZE / VCHUNK_SIZE)) & ~(size_t)7;
+    num_slab_classes = n;
+    vchunk_cap = slab_size[vchunk_class] - sizeof(vchunk_t);
+    for (unsigned i = 1; i < n; i++) {
+        shard_free_max[i] = (SLAB_PAGE_SIZE - SLAB_PAGE_HDR) / slab_size[i] / 64;
+        if (shard_free_max[i] > SHARD_FREE_MAX) shard_free_max[i] = SHARD_FREE_MAX;
+    }
+    for (unsigned node = 0; node < num_nodes; node++) {
+        pthread_mutex_init(&slab_nodes[node].lock, NULL);
+        for (unsigned i = 0; i < n; i++) pthread_mutex_init(&slabs[node][i].lock, NULL);
+    }
+}
+
+static inline slab_page_t *page_of(void *p) {
+    return (slab_page_t *)((uintptr_t)p & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+static inline uint32_t page_chunks(unsigned cls) {
+    return (SLAB_PAGE_SIZE - SLAB_PAGE_HDR) / slab_size[cls];
+}
+
+static inline void *page_chunk(slab_page_t *page, uint32_t i) {
+    return (uint8_t *)page + SLAB_PAGE_HDR + (size_t)i * slab_size[page->cls];
+}
+
+/* an empty page for node, counted against the limit: one from the pool,
+ * or a new one mapped at twice the size to align it. preferred rather
+ * than bound to the node: a full node spills over instead of failing
+ */
+slab_page_t *slab_page(unsigned node) {
+    if (!mem_reserve(SLAB_PAGE_SIZE)) return NULL;
+    slab_node_t *sn = &slab_nodes[node];
+    pthread_mutex_lock(&sn->lock);
+    slab_page_t *page = sn->pool;
+    if (page) sn->pool = page->next;
+    pthread_mutex_unlock(&sn->lock);
+    if (page) return page;
+
+    uint8_t *map = mmap(NULL, 2 * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        __atomic_sub_fetch(&mem_used, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    uint8_t *start = (uint8_t *)page_of(map + SLAB_PAGE_SIZE - 1);
+    if (start > map) munmap(map, start - map);
+    munmap(start + SLAB_PAGE_SIZE, map + SLAB_PAGE_SIZE - start);
+    if (settings.numa) {
+        unsigned long mask = 1ul << node_ids[node];
+        syscall(SYS_mbind, start, SLAB_PAGE_SIZE, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+    }
+    return (slab_page_t *)start;
+}
+
+/* a chunk of class cls from the pages of the class, taking a new page if
+ * none has one free. call with the class lock held
+ */
+void *class_alloc(unsigned node, unsigned cls) {
+    slab_class_t *sc = &slabs[node][cls];
+    slab_page_t *page;
+    while ((page = sc->partial) && !page->nfree) {
+        sc->partial = page->pnext;
+        page->partial = 0;
+    }
+    if (!page) {
+        page = slab_page(node);
+        if (!page) return NULL;
+        memset(page, 0, sizeof(*page));
+        page->cls = cls;
+        page->nfree = page_chunks(cls);
+        page->next = sc->pages;
+        sc->pages = page;
+        __atomic_store_n(&sc->npages, sc->npages + 1, __ATOMIC_RELAXED);
+        sc->partial = page;
+        page->partial = 1;
+    }
+    void *p;
+    if (page->free) {
+        p = page->free;
+        page->free = *(void **)p;
+    } else {
+        p = page_chunk(page, page->carved++);
+    }
+    page->nfree--;
+    return p;
+}
+
+void *slab_alloc(shard_t *sh, unsigned cls) {
+    pthread_mutex_lock(&sh->slab_lock);
+    void *p = sh->free[cls];
+    if (p) {
+        sh->free[cls] = *(void **)p;
+        sh->nfree[cls]--;
+    }
+    pthread_mutex_unlock(&sh->slab_lock);
+    if (p) return p;
+
+    slab_class_t *sc = &slabs[sh->node][cls];
+    pthread_mutex_lock(&sc->lock);
+    p = class_alloc(sh->node, cls);
+    pthread_mutex_unlock(&sc->lock);
+    return p;
+}
+
+/* a page whose draining is done goes to the pool, its memory back to the
+ * kernel but for the head, unless it is pinned by a walk. call with the
+ * class lock held
+ */
+void page_release(unsigned node, slab_page_t *page) {
+    slab_node_t *sn = &slab_nodes[node];
+    pthread_mutex_lock(&sn->lock);
+    if (page->pins) {
+        // page_unpin releases it once the walk is done
+        pthread_mutex_unlock(&sn->lock);
+        return;
+    }
+    slab_page_t **pp = &sn->draining;
+    while (*pp != page) pp = &(*pp)->dnext;
+    *pp = page->dnext;
+    sn->ndraining--;
+    pthread_mutex_unlock(&sn->lock);
+
+    madvise((uint8_t *)page + 4096, SLAB_PAGE_SIZE - 4096, MADV_DONTNEED);
+    pthread_mutex_lock(&sn->lock);
+    page->next = sn->pool;
+    sn->pool = page;
+    pthread_mutex_unlock(&sn->lock);
+}
+
+/* done walking a draining page, which could not be released meanwhile;
+ * if its chunks are all back, now it is. its class cannot change while
+ * it drains
+ */
+void page_unpin(unsigned node, slab_page_t *page) {
+    slab_class_t *sc = &slabs[node][page->cls];
+    slab_node_t *sn = &slab_nodes[node];
+    pthread_mutex_lock(&sc->lock);
+    pthread_mutex_lock(&sn->lock);
+    int last = --page->pins == 0;
+    pthread_mutex_unlock(&sn->lock);
+    if (last && page->nfree == page_chunks(page->cls)) page_release(node, page);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+/* give a chunk back to its page. the last one back releases a page being
+ * drained
+ */
+void page_free(unsigned node, unsigned cls, void *p) {
+    slab_class_t *sc = &slabs[node][cls];
+    slab_page_t *page = page_of(p);
+    pthread_mutex_lock(&sc->lock);
+    *(void **)p = page->free;
+    page->free = p;
+    if (++page->nfree == page_chunks(cls) && page->draining) {
+        page_release(node, page);
+    } else if (!page->partial && !page->draining) {
+        page->pnext = sc->partial;
+        sc->partial = page;
+        page->partial = 1;
+    }
+    pthread_mutex_unlock(&sc->lock);
+}
+
+void chunk_free(shard_t *sh, unsigned cls, void *p) {
+    // a page starts draining before the free lists are searched for its
+    // chunks, so under the lock one is either seen draining or found there
+    pthread_mutex_lock(&sh->slab_lock);
+    if (sh->nfree[cls] < shard_free_max[cls] &&
+        !__atomic_load_n(&page_of(p)->draining, __ATOMIC_RELAXED)) {
+        *(void **)p = sh->free[cls];
+        sh->free[cls] = p;
+        sh->nfree[cls]++;
+    } else {
+        page_free(sh->node, cls, p);
+    }
+    pthread_mutex_unlock(&sh->slab_lock);
+}
+
+static inline uint8_t *entry_key(cache_entry_t *entry) {
+    return entry->data;
+}
+
+static inline uint8_t *entry_value(cache_entry_t *entry) {
+    return entry->data + entry_value_off(entry->key_len);
+}
+
+static inline vchunks_t *entry_chunks(cache_entry_t *entry) {
+    return (vchunks_t *)entry_value(entry);
+}
+
+/* the front and length of a chunked value as of one moment, lock-free */
+uint32_t vchunks_snapshot(cache_entry_t *entry, vchunk_t **head, uint32_t *off) {
+    vchunks_t *d = entry_chunks(entry);
+    while (1) {
+        uint32_t seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        *head = __atomic_load_n(&d->head, __ATOMIC_RELAXED);
+        *off = __atomic_load_n(&d->head_off, __ATOMIC_RELAXED);
+        uint32_t len = __atomic_load_n(&entry->len, __ATOMIC_RELAXED);
+        // and the bytes and links the length covers
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&d->seq, __ATOMIC_RELAXED) == seq) return len;
+    }
+}
+
+/* up to max iovecs over the next len bytes of a chunked value from
+ * (*chunk, *off), moving that on past them. *got gets the bytes covered.
+ */
+int vchunks_iov(vchunk_t **chunk, uint32_t *off, size_t len, struct iovec *iov, int max,
+                size_t *got) {
+    int n = 0;
+    *got = 0;
+    while (len > 0 && n < max) {
+        if (*off == vchunk_cap) {
+            *chunk = (*chunk)->next;
+            *off = 0;
+        }
+        size_t take = vchunk_cap - *off;
+        if (take > len) take = len;
+        iov[n++] = (struct iovec){ (*chunk)->data + *off, take };
+        *off += take;
+        *got += take;
+        len -= take;
+    }
+    return n;
+}
+
+/* move (*chunk, *off) on by n bytes of a chunked value */
+void vchunks_skip(vchunk_t **chunk, uint32_t *off, size_t n) {
+    while (n > 0) {
+        if (*off == vchunk_cap) {
+            *chunk = (*chunk)->next;
+            *off = 0;
+        }
+        size_t take = vchunk_cap - *off;
+        if (take > n) take = n;
+        *off += take;
+        n -= take;
+    }
+}
+
+void vchunks_free(shard_t *sh, vchunk_t *chunk) {
+    while (chunk) {
+        vchunk_t *next = chunk->next;
+        chunk_free(sh, vchunk_class, chunk);
+        chunk = next;
+    }
+}
+
+void slab_free(cache_entry_t *entry) {
+    shard_t *sh = shard_for(entry->hv);
+    if (entry->chunked) vchunks_free(sh, entry_chunks(entry)->head);
+    if (entry->slab_class == 0) {
+        size_t size = entry_size(entry->key_len, entry->chunked ? sizeof(vchunks_t) : entry->len);
+        __atomic_sub_fetch(&mem_used, size, __ATOMIC_RELAXED);
+        free(entry);
+        return;
+    }
+    chunk_free(sh, entry->slab_class, entry);
+}
+
+/* what INCREMENT and DECREMENT take for a counter. a SET of 1 to 20
+ * decimal digits makes a COUNTER_TEXT; the first INCREMENT or DECREMENT
+ * replaces it with a COUNTER_WORD, the 8-byte number in network byte order,
+ * which later ones update in place. GET answers with a word in decimal, so
+ * clients see the digits whichever it is.
+ */
+#define COUNTER_TEXT 1
+#define COUNTER_WORD 2
+#define COUNTER_DIGITS 20 // in UINT64_MAX
+
+static inline uint64_t *entry_counter(cache_entry_t *entry) {
+    return (uint64_t *)entry_value(entry);
+}
+
+/* the number len decimal digits at p spell; -1 if they are not one that
+ * fits in 64 bits
+ */
+int parse_counter(const uint8_t *p, size_t len, uint64_t *v) {
+    if (len == 0 || len > COUNTER_DIGITS) return -1;
+    uint64_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned d = p[i] - '0';
+        if (d > 9 || n > (UINT64_MAX - d) / 10) return -1;
+        n = n * 10 + d;
+    }
+    *v = n;
+    return 0;
+}
+
+/* a COUNTER_WORD in decimal into buf, which holds COUNTER_DIGITS + 1 */
+size_t counter_text(cache_entry_t *entry, char *buf) {
+    uint64_t v = __atomic_load_n(entry_counter(entry), __ATOMIC_RELAXED);
+    return sprintf(buf, "%lu", be64toh(v));
+}
+
+/* mark a filled in entry COUNTER_TEXT if its value is a number */
+void entry_check_counter(cache_entry_t *entry) {
+    uint64_t v;
+    if (!entry->chunked && parse_counter(entry_value(entry), entry->len, &v) == 0)
+        entry->counter = COUNTER_TEXT;
+}
+
+void entry_ref(cache_entry_t *entry) {
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void entry_release(cache_entry_t *entry) {
+    if (entry && __atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        slab_free(entry);
+}
+
+/* append a response fragment to the connection's output buffer. nothing
+ * touches the socket until the batch of requests parsed from one read has
+ * been processed; then conn_flush sends all of their responses at once.
+ */
+void conn_write(conn_t *c, const void *buf, size_t len) {
+    if (c->state == CONN_CLOSE) return;
+
+    if (c->wbytes + len > c->wsize) {
+        size_t nsize = c->wsize ? c->wsize : RBUF_SIZE;
+        while (nsize < c->wbytes + len) nsize *= 2;
+        uint8_t *nbuf = realloc(c->wbuf, nsize);
+        if (!nbuf) {
+            c->state = CONN_CLOSE;
+            return;
+        }
+        c->wbuf = nbuf;
+        c->wsize = nsize;
+    }
+    memcpy(c->wbuf + c->wbytes, buf, len);
+    c->wbytes += len;
+}
+
+/* copy len bytes of a chunked value, from chunk and off on */
+void conn_write_chunks(conn_t *c, vchunk_t *chunk, uint32_t off, size_t len) {
+    while (len > 0) {
+        struct iovec iov[MAX_IOV];
+        size_t got;
+        int n = vchunks_iov(&chunk, &off, len, iov, MAX_IOV, &got);
+        for (int i = 0; i < n; i++) conn_write(c, iov[i].iov_base, iov[i].iov_len);
+        len -= got;
+    }
+}
+
+/* queue len bytes of a value by reference, taking over the caller's
+ * reference; chunk and off say where a chunked one starts. io_uring
+ * connections send one contiguous buffer, so they get a copy.
+ */
+void conn_write_value(conn_t *c, cache_entry_t *v, uint32_t len, vchunk_t *chunk, uint32_t off) {
+    if (c->io == IO_URING || c->state == CONN_CLOSE) {
+        if (chunk) conn_write_chunks(c, chunk, off, len);
+        else conn_write(c, entry_value(v), len);
+        entry_release(v);
+        return;
+    }
+
+    if (c->nrefs == c->refs_size) {
+        int nsize = c->refs_size ? c->refs_size * 2 : 16;
+        out_ref_t *nrefs = realloc(c->refs, nsize * sizeof(out_ref_t));
+        if (!nrefs) {
+            entry_release(v);
+            c->state = CONN_CLOSE;
+            return;
+        }
+        c->refs = nrefs;
+        c->refs_size = nsize;
+    }
+    c->refs[c->nrefs++] = (out_ref_t){
+        .at = c->wbytes, .val = v, .len = len, .off = off, .chunk = chunk,
+    };
+}
+
+int conn_has_output(conn_t *c) {
+    return c->wcurr < c->wbytes || c->rcurr < c->nrefs;
+}
+
+/* release the references behind zerocopy sends the kernel has completed */
+void conn_reap_zerocopy(conn_t *c) {
+    while (c->nzc > 0) {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) continue;
+
+            // completions cover [ee_info, ee_data] and arrive in order
+            while (c->nzc > 0 && (int32_t)(c->zc[c->zc_head].id - serr->ee_data) <= 0) {
+                entry_release(c->zc[c->zc_head].val);
+                c->zc_head++;
+                c->nzc--;
+            }
+        }
+    }
+    c->zc_head = 0;
+}
+
+/* remember a zerocopy send until the kernel says it is done with it */
+int conn_track_zerocopy(conn_t *c, cache_entry_t *v) {
+    if (c->zc_head > 0 && c->zc_head + c->nzc == c->zc_size) {
+        memmove(c->zc, c->zc + c->zc_head, c->nzc * sizeof(zc_pending_t));
+        c->zc_head = 0;
+    }
+    if (c->zc_head + c->nzc == c->zc_size) {
+        int nsize = c->zc_size ? c->zc_size * 2 : 16;
+        zc_pending_t *nzc = realloc(c->zc, nsize * sizeof(zc_pending_t));
+        if (!nzc) return -1;
+        c->zc = nzc;
+        c->zc_size = nsize;
+    }
+    entry_ref(v);
+    c->zc[c->zc_head + c->nzc++] = (zc_pending_t){ .id = c->zc_next++, .val = v };
+    return 0;
+}
+
+int conn_wants_zerocopy(conn_t *c, out_ref_t *r) {
+    if (settings.zerocopy_min == 0 || r->len < settings.zerocopy_min) return 0;
+    if (c->zerocopy == 0) {
+        int one = 1;
+        c->zerocopy = setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1 : -1;
+    }
+    return c->zerocopy > 0;
+}
+
+/* account for n bytes taken by the socket, dropping finished references */
+void conn_advance(conn_t *c, size_t n) {
+    while (n > 0) {
+        size_t next_at = c->rcurr < c->nrefs ? c->refs[c->rcurr].at : c->wbytes;
+        if (c->wcurr < next_at) {
+            size_t take = next_at - c->wcurr;
+            if (take > n) take = n;
+            c->wcurr += take;
+            n -= take;
+            continue;
+        }
+        out_ref_t *r = &c->refs[c->rcurr];
+        size_t take = r->len - c->rsent;
+        if (take > n) take = n;
+        c->rsent += take;
+        n -= take;
+        if (r->chunk) vchunks_skip(&r->chunk, &r->off, take);
+        if (c->rsent == r->len) {
+            entry_release(r->val);
+            c->rcurr++;
+            c->rsent = 0;
+        }
+    }
+    // zero-length values have nothing to wait for
+    while (c->rcurr < c->nrefs && c->refs[c->rcurr].at == c->wcurr &&
+           c->refs[c->rcurr].len == 0) {
+        entry_release(c->refs[c->rcurr++].val);
+    }
+}
+
+/* send buffered output as iovecs over wbuf and the referenced values. large
+ * values go out in a sendmsg of their own with MSG_ZEROCOPY, and keep their
+ * reference until the completion shows up on the socket's error queue.
+ * returns 1 once drained, 0 if a non-blocking socket is full and -1 if the
+ * connection is gone.
+ */
+int conn_flush(conn_t *c) {
+    if (c->nzc > 0) conn_reap_zerocopy(c);
+    conn_advance(c, 0);
+
+    while (conn_has_output(c)) {
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        int flags = MSG_NOSIGNAL;
+        cache_entry_t *zc = NULL;
+
+        size_t pos = c->wcurr;
+        for (int i = c->rcurr; iovcnt < MAX_IOV; i++) {
+            size_t next_at = i < c->nrefs ? c->refs[i].at : c->wbytes;
+            if (pos < next_at) {
+                iov[iovcnt++] = (struct iovec){ c->wbuf + pos, next_at - pos };
+                pos = next_at;
+            }
+            if (i >= c->nrefs || iovcnt == MAX_IOV) break;
+
+            out_ref_t *r = &c->refs[i];
+            size_t off = i == c->rcurr ? c->rsent : 0;
+            if (conn_wants_zerocopy(c, r)) {
+                // a zerocopy value goes alone, after whatever precedes it
+                if (iovcnt > 0) break;
+                zc = r->val;
+                flags |= MSG_ZEROCOPY;
+            }
+            if (r->chunk) {
+                // the chunk and offset have been moved past what was sent
+                vchunk_t *chunk = r->chunk;
+                uint32_t coff = r->off;
+                size_t got;
+                iovcnt += vchunks_iov(&chunk, &coff, r->len - off, iov + iovcnt,
+                                      MAX_IOV - iovcnt, &got);
+                // out of iovecs inside the value: what follows has to wait
+                if (got < r->len - off) break;
+            } else if (r->len > off) {
+                iov[iovcnt++] = (struct iovec){ entry_value(r->val) + off, r->len - off };
+            }
+            if (zc) break;
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t n = sendmsg(c->fd, &msg, flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->state = CONN_WRITE;
+                return 0;
+            }
+            if (zc && errno == ENOBUFS) {
+                // out of optmem for zerocopy; copy this connection from now on
+                c->zerocopy = -1;
+                continue;
+            }
+            c->state = CONN_CLOSE;
+            return -1;
+        }
+        if (zc && conn_track_zerocopy(c, zc) < 0) {
+            c->state = CONN_CLOSE;
+            return -1;
+        }
+        conn_advance(c, n);
+    }
+
+    c->wbytes = c->wcurr = 0;
+    c->nrefs = c->rcurr = 0;
+    c->rsent = 0;
+    if (c->state == CONN_WRITE) c->state = CONN_READ;
+
+    // don't let one burst pin a large buffer on an idle connection
+    if (c->wsize > 4 * RBUF_SIZE) {
+        free(c->wbuf);
+        c->wbuf = NULL;
+        c->wsize = 0;
+    }
+    return 1;
+}
+
+/* drop queued output. values of zerocopy sends the kernel has not released
+ * stay referenced; see conn_park
+ */
+void conn_release_output(conn_t *c) {
+    for (int i = c->rcurr; i < c->nrefs; i++) entry_release(c->refs[i].val);
+    c->nrefs = c->rcurr = 0;
+    free(c->refs);
+    c->refs = NULL;
+    if (c->nzc > 0) conn_reap_zerocopy(c);
+}
+
+void conn_free_parked(worker_t *w, conn_t *c) {
+    if (c->io == IO_EPOLL) epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->zc);
+    free(c);
+}
+
+/* keep a closing connection whose zerocopy sends are still pending on the
+ * worker's list, so the kernel isn't left reading value memory we reuse.
+ * it is shut down and holds nothing else; reap_parked frees it once the
+ * completions are in. returns 0 if nothing is pending and the caller
+ * closes it as usual
+ */
+int conn_park(worker_t *w, conn_t *c) {
+    if (c->nzc == 0) return 0;
+    shutdown(c->fd, SHUT_RDWR);
+    c->parked = 1;
+    c->next_parked = w->parked;
+    w->parked = c;
+    return 1;
+}
+
+/* free the parked connections whose zerocopy sends have all completed */
+void reap_parked(worker_t *w) {
+    for (conn_t **pp = &w->parked; *pp;) {
+        conn_t *c = *pp;
+        conn_reap_zerocopy(c);
+        if (c->nzc > 0) {
+            pp = &c->next_parked;
+            continue;
+        }
+        *pp = c->next_parked;
+        conn_free_parked(w, c);
+    }
+}
+
+/* we coalesce responses ourselves, so Nagle would only add latency */
+void conn_set_sockopts(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* every thread that touches the table registers once before doing so */
+void epoch_register(void) {
+    epoch_rec_t *rec = aligned_alloc(64, sizeof(epoch_rec_t));
+    if (!rec) {
+        perror("epoch");
+        exit(EXIT_FAILURE);
+    }
+    memset(rec, 0, sizeof(*rec));
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_mutex_lock(&epoch_recs_lock);
+    rec->next = epoch_recs;
+    __atomic_store_n(&epoch_recs, rec, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&epoch_recs_lock);
+    my_epoch = rec;
+}
+
+static inline void epoch_enter(void) {
+    __atomic_store_n(&my_epoch->active, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_RELAXED);
+    // the announcement has to be visible before we load any table pointer
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void epoch_exit(void) {
+    __atomic_store_n(&my_epoch->active, 0, __ATOMIC_RELEASE);
+}
+
+/* move the global epoch on if every active reader has seen it */
+uint64_t epoch_try_advance(void) {
+    uint64_t e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (epoch_rec_t *r = __atomic_load_n(&epoch_recs, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t a = __atomic_load_n(&r->active, __ATOMIC_SEQ_CST);
+        if (a && a != e) return e;
+    }
+    if (__atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return e + 1;
+    return e;
+}
+
+/* free what rec retired at least two epochs ago. call with rec->lock held */
+void limbo_reclaim(epoch_rec_t *rec) {
+    uint64_t e = epoch_try_advance();
+    size_t n = 0;
+    while (n < rec->nlimbo && rec->limbo[n].epoch + 2 <= e) {
+        rec->limbo[n].fn(rec->limbo[n].p);
+        n++;
+    }
+    if (n) {
+        memmove(rec->limbo, rec->limbo + n, (rec->nlimbo - n) * sizeof(retired_t));
+        __atomic_store_n(&rec->nlimbo, rec->nlimbo - n, __ATOMIC_RELAXED);
+    }
+}
+
+/* free what this thread retired. workers call it between batches,
+ * outside any read section.
+ */
+void epoch_reclaim(void) {
+    epoch_rec_t *rec = my_epoch;
+    if (!__atomic_load_n(&rec->nlimbo, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&rec->lock);
+    limbo_reclaim(rec);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+/* free what the other threads retired, for those that went idle before
+ * they could. from the timer thread; a busy worker is skipped
+ */
+void epoch_reclaim_others(void) {
+    for (epoch_rec_t *r = __atomic_load_n(&epoch_recs, __ATOMIC_ACQUIRE); r; r = r->next) {
+        if (r == my_epoch || !__atomic_load_n(&r->nlimbo, __ATOMIC_RELAXED)) continue;
+        if (pthread_mutex_trylock(&r->lock)) continue;
+        limbo_reclaim(r);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/* hand p to fn once no reader can still be looking at it */
+void epoch_retire(void *p, void (*fn)(void *)) {
+    epoch_rec_t *rec = my_epoch;
+    pthread_mutex_lock(&rec->lock);
+    if (rec->nlimbo == rec->limbo_size) {
+        size_t size = rec->limbo_size ? rec->limbo_size * 2 : 64;
+        retired_t *l = realloc(rec->limbo, size * sizeof(retired_t));
+        if (!l) {
+            perror("epoch");
+            exit(EXIT_FAILURE);
+        }
+        rec->limbo = l;
+        rec->limbo_size = size;
+    }
+    rec->limbo[rec->nlimbo] = (retired_t){
+        .p = p,
+        .fn = fn,
+        .epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+    };
+    __atomic_store_n(&rec->nlimbo, rec->nlimbo + 1, __ATOMIC_RELAXED);
+    if (rec->nlimbo % 64 == 0) limbo_reclaim(rec);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+void entry_retire(void *p) {
+    entry_release(p);
+}
+
+table_t *table_alloc(size_t nbuckets) {
+    table_t *t = calloc(1, sizeof(table_t) + nbuckets * sizeof(cache_entry_t *));
+    if (!t) {
+        perror("table");
+        exit(EXIT_FAILURE);
+    }
+    t->mask = nbuckets - 1;
+    return t;
+}
+
+swiss_t *swiss_alloc(size_t ngroups) {
+    size_t nslots = ngroups * GROUP_SIZE;
+    size_t size = sizeof(swiss_t) + nslots + nslots * sizeof(swiss_slot_t);
+    swiss_t *t = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (!t) {
+        perror("table");
+        exit(EXIT_FAILURE);
+    }
+    t->mask = ngroups - 1;
+    t->used = 0;
+    t->ctrl = (uint8_t *)(t + 1);
+    t->slots = (swiss_slot_t *)(t->ctrl + nslots);
+    memset(t->ctrl, CTRL_EMPTY, nslots);
+    memset(t->slots, 0, nslots * sizeof(swiss_slot_t));
+    return t;
+}
+
+void shards_init(unsigned n) {
+    shards = aligned_alloc(64, n * sizeof(shard_t));
+    if (!shards) {
+        perror("shards");
+        exit(EXIT_FAILURE);
+    }
+    memset(shards, 0, n * sizeof(shard_t));
+    for (unsigned i = 0; i < n; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        pthread_mutex_init(&shards[i].slab_lock, NULL);
+        shards[i].node = (uint64_t)i * num_nodes / n;
+        shards[i].wheel.now = current_secs();
+        if (settings.index == INDEX_SWISS) shards[i].swiss = swiss_alloc(SHARD_BUCKETS / GROUP_SIZE);
+        else shards[i].table = table_alloc(SHARD_BUCKETS);
+    }
+    shard_mask = n - 1;
+    while ((1u << shard_bits) < n) shard_bits++;
+}
+
+static inline int entry_matches(cache_entry_t *entry, const char *key, size_t key_len,
+                                uint32_t hv) {
+    return entry->hv == hv && entry->key_len == key_len &&
+           key_eq(entry_key(entry), (const uint8_t *)key, key_len);
+}
+
+/* chained index */
+
+/* lock-free lookup. a hit is good as found, but a miss only counts if no
+ * resize moved chains meanwhile.
+ */
+cache_entry_t *chain_lookup(shard_t *sh, const char *key, size_t key_len, uint32_t hv) {
+    unsigned *seqp = &sh->seq[hv & (CHAIN_SEQS - 1)];
+    while (1) {
+        unsigned seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        // the new table first: seeing it means seeing the old one it replaced
+        table_t *tables[2];
+        tables[0] = __atomic_load_n(&sh->table, __ATOMIC_ACQUIRE);
+        tables[1] = __atomic_load_n(&sh->old_table, __ATOMIC_ACQUIRE);
+        cache_entry_t *entry = NULL;
+        for (int k = 0; k < 2 && tables[k] && !entry; k++) {
+            table_t *t = tables[k];
+            entry = __atomic_load_n(&t->buckets[hv & t->mask], __ATOMIC_ACQUIRE);
+            unsigned steps = 0;
+            while (entry) {
+                if (entry_matches(entry, key, key_len, hv)) return entry;
+                // a resize can splice chains together; don't chase them forever
+                if (++steps % 256 == 0 && __atomic_load_n(seqp, __ATOMIC_ACQUIRE) != seq)
+                    break;
+                entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE);
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!entry && __atomic_load_n(seqp, __ATOMIC_RELAXED) == seq) return NULL;
+    }
+}
+
+/* the bucket an entry with hash hv belongs on: in the old table until
+ * its bucket there has been moved. call with sh->lock held
+ */
+static inline cache_entry_t **chain_bucket(shard_t *sh, uint32_t hv) {
+    table_t *old = sh->old_table;
+    if (old && (hv & old->mask) >= sh->migrated) return &old->buckets[hv & old->mask];
+    return &sh->table->buckets[hv & sh->table->mask];
+}
+
+/* move up to n buckets of the old table into the new one, and retire the
+ * old table once it is empty
+ */
+void chain_migrate(shard_t *sh, size_t n) {
+    table_t *old = sh->old_table, *t = sh->table;
+    size_t from = sh->migrated;
+    if (n > old->mask + 1 - from) n = old->mask + 1 - from;
+    size_t stripes = n < CHAIN_SEQS ? n : CHAIN_SEQS;
+
+    for (size_t i = 0; i < stripes; i++) {
+        unsigned *seq = &sh->seq[(from + i) & (CHAIN_SEQS - 1)];
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (; n && sh->migrated <= old->mask; n--, sh->migrated++) {
+        cache_entry_t *entry = old->buckets[sh->migrated], *next;
+        __atomic_store_n(&old->buckets[sh->migrated], NULL, __ATOMIC_RELAXED);
+        for (; entry; entry = next) {
+            next = entry->next;
+            cache_entry_t **b = &t->buckets[entry->hv & t->mask];
+            __atomic_store_n(&entry->next, *b, __ATOMIC_RELAXED);
+            __atomic_store_n(b, entry, __ATOMIC_RELAXED);
+        }
+    }
+    for (size_t i = 0; i < stripes; i++) {
+        unsigned *seq = &sh->seq[(from + i) & (CHAIN_SEQS - 1)];
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+    }
+
+    if (sh->migrated > old->mask) {
+        __atomic_store_n(&sh->old_table, NULL, __ATOMIC_RELEASE);
+        epoch_retire(old, free);
+    }
+}
+
+/* double the bucket array once the chains average more than one entry.
+ * nothing moves yet; inserts carry the chains over from here on.
+ */
+void chain_grow(shard_t *sh) {
+    table_t *old = sh->table;
+    sh->migrated = 0;
+    __atomic_store_n(&sh->old_table, old, __ATOMIC_RELAXED);
+    __atomic_store_n(&sh->table, table_alloc((old->mask + 1) * 2), __ATOMIC_RELEASE);
+}
+
+void chain_insert(shard_t *sh, cache_entry_t *entry) {
+    if (sh->old_table) chain_migrate(sh, MIGRATE_STEP);
+    if (!sh->old_table && sh->count > sh->table->mask + 1) chain_grow(sh);
+    cache_entry_t **b = chain_bucket(sh, entry->hv);
+    entry->next = *b;
+    __atomic_store_n(b, entry, __ATOMIC_RELEASE);
+}
+
+cache_entry_t **chain_link(shard_t *sh, cache_entry_t *entry) {
+    cache_entry_t **link = chain_bucket(sh, entry->hv);
+    while (*link != entry) link = &(*link)->next;
+    return link;
+}
+
+void chain_remove(shard_t *sh, cache_entry_t *entry) {
+    // readers standing on entry still find their way on through its next
+    __atomic_store_n(chain_link(sh, entry), entry->next, __ATOMIC_RELEASE);
+}
+
+void chain_replace(shard_t *sh, cache_entry_t *old, cache_entry_t *entry) {
+    entry->next = old->next;
+    __atomic_store_n(chain_link(sh, old), entry, __ATOMIC_RELEASE);
+}
+
+/* swiss index: an open-addressing array of {entry, hash} slots, probed a
+ * group of 16 at a time through one control byte per slot that holds 7
+ * bits of the hash, so the full key is only compared on a tag match.
+ * writers fill a slot before its control byte and never bring EMPTY back,
+ * which lets readers probe without locks. a resize publishes a new array
+ * and moves slots into it a few groups at a time, each into the new array
+ * before it is deleted from the old, so readers search the old then the
+ * new and can't miss an entry in flight.
+ */
+static inline uint8_t swiss_tag(uint32_t hv) {
+    return hv & 0x7f;
+}
+
+/* bit i set for every byte i of the group equal to b */
+static inline unsigned group_match(const uint8_t *g, uint8_t b) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *)g);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(b)));
+#else
+    unsigned m = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        if (__atomic_load_n(&g[i], __ATOMIC_RELAXED) == b) m |= 1u << i;
+    return m;
+#endif
+}
+
+/* EMPTY and DELETED are the control bytes with the top bit set */
+static inline unsigned group_free(const uint8_t *g) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *)g));
+#else
+    unsigned m = 0;
+    for (int i = 0; i < GROUP_SIZE; i++)
+        if (__atomic_load_n(&g[i], __ATOMIC_RELAXED) & 0x80) m |= 1u << i;
+    return m;
+#endif
+}
+
+/* find key in t, lock-free or not. *slot gets its index if wanted */
+cache_entry_t *swiss_find(swiss_t *t, const char *key, size_t key_len, uint32_t hv,
+                          size_t *slot) {
+    uint8_t tag = swiss_tag(hv);
+    size_t g = (hv >> 7) & t->mask;
+
+    // triangular steps visit every group of a power-of-two table once
+    for (size_t step = 1; step <= t->mask + 1; step++) {
+        const uint8_t *ctrl = t->ctrl + g * GROUP_SIZE;
+        unsigned m = group_match(ctrl, tag);
+        // see the slot a control byte was published for
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        while (m) {
+            size_t i = g * GROUP_SIZE + __builtin_ctz(m);
+            m &= m - 1;
+            cache_entry_t *entry = __atomic_load_n(&t->slots[i].entry, __ATOMIC_RELAXED);
+            if (entry && entry_matches(entry, key, key_len, hv)) {
+                if (slot) *slot = i;
+                return entry;
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) return NULL;
+        g = (g + step) & t->mask;
+    }
+    return NULL;
+}
+
+/* put entry in the first free slot on its probe sequence */
+void swiss_place(swiss_t *t, cache_entry_t *entry, uint32_t hv) {
+    size_t g = (hv >> 7) & t->mask;
+    for (size_t step = 1;; step++) {
+        unsigned m = group_free(t->ctrl + g * GROUP_SIZE);
+        if (m) {
+            size_t i = g * GROUP_SIZE + __builtin_ctz(m);
+            if (t->ctrl[i] == CTRL_EMPTY) t->used++;
+            t->slots[i].hv = hv;
+            __atomic_store_n(&t->slots[i].entry, entry, __ATOMIC_RELAXED);
+            __atomic_store_n(&t->ctrl[i], swiss_tag(hv), __ATOMIC_RELEASE);
+            return;
+        }
+        g = (g + step) & t->mask;
+    }
+}
+
+/* move up to n groups of the old array into the new one, and retire the
+ * old array once it is empty
+ */
+void swiss_migrate(shard_t *sh, size_t n) {
+    swiss_t *old = sh->old_swiss, *t = sh->swiss;
+    for (; n && sh->migrated <= old->mask; n--, sh->migrated++) {
+        for (size_t i = sh->migrated * GROUP_SIZE; i < (sh->migrated + 1) * GROUP_SIZE; i++) {
+            if (old->ctrl[i] & 0x80) continue;
+            swiss_place(t, old->slots[i].entry, old->slots[i].hv);
+            __atomic_store_n(&old->ctrl[i], CTRL_DELETED, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (sh->migrated > old->mask) {
+        __atomic_store_n(&sh->old_swiss, NULL, __ATOMIC_RELEASE);
+        epoch_retire(old, free);
+    }
+}
+
+/* start over at twice the size when half full, or at the same size when
+ * tombstones are what fills it. inserts move the slots over from here on.
+ */
+void swiss_rehash(shard_t *sh) {
+    swiss_t *old = sh->swiss;
+    size_t ngroups = old->mask + 1;
+    if (sh->count >= ngroups * GROUP_SIZE / 2) ngroups *= 2;
+
+    sh->migrated = 0;
+    __atomic_store_n(&sh->old_swiss, old, __ATOMIC_RELAXED);
+    __atomic_store_n(&sh->swiss, swiss_alloc(ngroups), __ATOMIC_RELEASE);
+}
+
+void swiss_insert(shard_t *sh, cache_entry_t *entry) {
+    if (sh->old_swiss) swiss_migrate(sh, MIGRATE_STEP);
+    swiss_t *t = sh->swiss;
+    if (t->used >= (t->mask + 1) * GROUP_SIZE * 7 / 8) {
+        // only if stores outran a migration: finish it first
+        if (sh->old_swiss) swiss_migrate(sh, SIZE_MAX);
+        swiss_rehash(sh);
+    }
+    swiss_place(sh->swiss, entry, entry->hv);
+}
+
+/* the array entry is in, and its slot there. call with sh->lock held */
+swiss_t *swiss_slot_of(shard_t *sh, cache_entry_t *entry, size_t *slot) {
+    if (sh->old_swiss &&
+        swiss_find(sh->old_swiss, (char *)entry_key(entry), entry->key_len, entry->hv, slot))
+        return sh->old_swiss;
+    swiss_find(sh->swiss, (char *)entry_key(entry), entry->key_len, entry->hv, slot);
+    return sh->swiss;
+}
+
+void swiss_replace(shard_t *sh, cache_entry_t *old, cache_entry_t *entry) {
+    // same key, same tag; only the pointer changes
+    size_t i;
+    swiss_t *t = swiss_slot_of(sh, old, &i);
+    __atomic_store_n(&t->slots[i].entry, entry, __ATOMIC_RELEASE);
+}
+
+void swiss_remove(shard_t *sh, cache_entry_t *entry) {
+    size_t i;
+    swiss_t *t = swiss_slot_of(sh, entry, &i);
+    // the slot keeps pointing at entry until reused; readers that saw the
+    // old control byte may still follow it
+    __atomic_store_n(&t->ctrl[i], CTRL_DELETED, __ATOMIC_RELEASE);
+}
+
+/* lock-free lookup in the old array, then the new. a miss only counts if
+ * no resize started meanwhile: one that did may have moved the entry out
+ * of the array we took for the new one.
+ */
+cache_entry_t *swiss_lookup(shard_t *sh, const char *key, size_t key_len, uint32_t hv) {
+    while (1) {
+        // the new array first: seeing it means seeing the old one it replaced
+        swiss_t *t = __atomic_load_n(&sh->swiss, __ATOMIC_ACQUIRE);
+        swiss_t *old = __atomic_load_n(&sh->old_swiss, __ATOMIC_ACQUIRE);
+        cache_entry_t *entry = NULL;
+        if (old) entry = swiss_find(old, key, key_len, hv, NULL);
+        if (!entry) entry = swiss_find(t, key, key_len, hv, NULL);
+        if (entry) return entry;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&sh->swiss, __ATOMIC_RELAXED) == t) return NULL;
+    }
+}
+
+/* move some more of a resize along. call with sh->lock held */
+void index_migrate(shard_t *sh, size_t n) {
+    if (sh->old_swiss) swiss_migrate(sh, n);
+    if (sh->old_table) chain_migrate(sh, n);
+}
+
+/* lock-free lookup; call between epoch_enter() and epoch_exit() */
+cache_entry_t *lookup_entry(shard_t *sh, const char *key, size_t key_len, uint32_t hv) {
+    if (settings.index == INDEX_SWISS) return swiss_lookup(sh, key, key_len, hv);
+    return chain_lookup(sh, key, key_len, hv);
+}
+
+/* call with sh->lock held */
+cache_entry_t *find_entry(shard_t *sh, const char *key, size_t key_len, uint32_t hv) {
+    if (settings.index == INDEX_SWISS) {
+        cache_entry_t *entry = NULL;
+        if (sh->old_swiss) entry = swiss_find(sh->old_swiss, key, key_len, hv, NULL);
+        return entry ? entry : swiss_find(sh->swiss, key, key_len, hv, NULL);
+    }
+
+    cache_entry_t *entry = *chain_bucket(sh, hv);
+    while (entry && !entry_matches(entry, key, key_len, hv)) entry = entry->next;
+    return entry;
+}
+
+/* the list functions below are called with sh->lock held */
+void evict_push(evict_lists_t *l, cache_entry_t *entry, int seg) {
+    entry->seg = seg;
+    entry->eprev = NULL;
+    entry->enext = l->head[seg];
+    if (l->head[seg]) l->head[seg]->eprev = entry;
+    else l->tail[seg] = entry;
+    l->head[seg] = entry;
+    l->count[seg]++;
+}
+
+void evict_unlink(evict_lists_t *l, cache_entry_t *entry) {
+    int seg = entry->seg;
+    if (l->hand == entry) l->hand = entry->eprev;
+    if (entry->eprev) entry->eprev->enext = entry->enext;
+    else l->head[seg] = entry->enext;
+    if (entry->enext) entry->enext->eprev = entry->eprev;
+    else l->tail[seg] = entry->eprev;
+    l->count[seg]--;
+}
+
+/* move entry to the head of seg, forgetting its hits */
+void evict_move(evict_lists_t *l, cache_entry_t *entry, int seg) {
+    evict_unlink(l, entry);
+    __atomic_store_n(&entry->hits, 0, __ATOMIC_RELAXED);
+    evict_push(l, entry, seg);
+}
+
+static inline uint8_t hits_of(cache_entry_t *entry) {
+    return __atomic_load_n(&entry->hits, __ATOMIC_RELAXED);
+}
+
+/* count a hit, up to max. racing readers may lose one; that's fine */
+static inline void hits_bump(cache_entry_t *entry, uint8_t max) {
+    uint8_t hits = hits_of(entry);
+    if (hits < max) __atomic_store_n(&entry->hits, hits + 1, __ATOMIC_RELAXED);
+}
+
+/* -e lru: segmented LRU. new entries start in HOT; entries falling off HOT
+ * or WARM go to WARM if they were hit meanwhile, else to COLD, and
+ * evictions come from the tail of COLD. a hit only marks the entry, at
+ * most once per LRU_BUMP_INTERVAL.
+ */
+#define LRU_HOT 0
+#define LRU_WARM 1
+#define LRU_COLD 2
+#define LRU_HOT_PCT 20
+#define LRU_WARM_PCT 40
+#define LRU_BUMP_INTERVAL 1 // seconds
+
+void lru_touch(cache_entry_t *entry) {
+    uint32_t now = current_secs();
+    if (now - __atomic_load_n(&entry->atime, __ATOMIC_RELAXED) < LRU_BUMP_INTERVAL) return;
+    __atomic_store_n(&entry->atime, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->hits, 1, __ATOMIC_RELAXED);
+}
+
+void lru_insert(shard_t *sh, evict_lists_t *l, cache_entry_t *entry) {
+    (void)sh;
+    evict_push(l, entry, LRU_HOT);
+
+    size_t total = l->count[LRU_HOT] + l->count[LRU_WARM] + l->count[LRU_COLD];
+    while (l->count[LRU_HOT] > total * LRU_HOT_PCT / 100) {
+        cache_entry_t *e = l->tail[LRU_HOT];
+        evict_move(l, e, hits_of(e) ? LRU_WARM : LRU_COLD);
+    }
+    // every pass clears one mark, so this ends
+    while (l->count[LRU_WARM] > total * LRU_WARM_PCT / 100) {
+        cache_entry_t *e = l->tail[LRU_WARM];
+        evict_move(l, e, hits_of(e) ? LRU_WARM : LRU_COLD);
+    }
+}
+
+/* COLD entries that were hit get another round in WARM, a few at a time */
+cache_entry_t *lru_victim(shard_t *sh, evict_lists_t *l) {
+    (void)sh;
+    for (int i = 0; i < 8 && l->tail[LRU_COLD]; i++) {
+        cache_entry_t *entry = l->tail[LRU_COLD];
+        if (!hits_of(entry)) return entry;
+        evict_move(l, entry, LRU_WARM);
+    }
+    for (int seg = LRU_COLD; seg >= LRU_HOT; seg--)
+        if (l->tail[seg]) return l->tail[seg];
+    return NULL;
+}
+
+/* -e clock: one list swept from the tail towards the head by a hand that
+ * clears hit marks and stops at the first unmarked entry. a hit sets the
+ * mark and nothing else; new entries go right behind the hand.
+ */
+void clock_touch(cache_entry_t *entry) {
+    if (!hits_of(entry)) __atomic_store_n(&entry->hits, 1, __ATOMIC_RELAXED);
+}
+
+void clock_insert(shard_t *sh, evict_lists_t *l, cache_entry_t *entry) {
+    (void)sh;
+    cache_entry_t *hand = l->hand;
+    // the hand reaches the head last when it is at the tail or not started
+    if (!hand || !hand->enext) {
+        evict_push(l, entry, 0);
+        return;
+    }
+    entry->seg = 0;
+    entry->eprev = hand;
+    entry->enext = hand->enext;
+    hand->enext->eprev = entry;
+    hand->enext = entry;
+    l->count[0]++;
+}
+
+cache_entry_t *clock_victim(shard_t *sh, evict_lists_t *l) {
+    (void)sh;
+    cache_entry_t *entry = l->hand ? l->hand : l->tail[0];
+    // two sweeps clear every mark
+    for (size_t n = 0; entry && n < 2 * l->count[0]; n++) {
+        if (!hits_of(entry)) break;
+        __atomic_store_n(&entry->hits, 0, __ATOMIC_RELAXED);
+        entry = entry->eprev ? entry->eprev : l->tail[0];
+    }
+    if (entry) l->hand = entry->eprev;
+    return entry;
+}
+
+/* -e s3fifo: a small FIFO takes new entries and a main FIFO the ones that
+ * were hit while in it. an entry leaving the small queue unhit is evicted
+ * and its hash kept in a ghost table; a key that comes back while still
+ * remembered goes straight to main. main entries that were hit go round
+ * again with one hit fewer.
+ */
+#define S3_SMALL 0
+#define S3_MAIN 1
+#define S3_SMALL_PCT 10
+#define S3_HITS_MAX 3
+#define GHOST_SIZE 4096 // per shard, direct mapped
+
+void s3fifo_touch(cache_entry_t *entry) {
+    hits_bump(entry, S3_HITS_MAX);
+}
+
+void s3fifo_insert(shard_t *sh, evict_lists_t *l, cache_entry_t *entry) {
+    uint32_t *ghost = &sh->ghost[entry->hv & (GHOST_SIZE - 1)];
+    if (*ghost == entry->hv) {
+        *ghost = 0;
+        evict_push(l, entry, S3_MAIN);
+    } else {
+        evict_push(l, entry, S3_SMALL);
+    }
+}
+
+cache_entry_t *s3fifo_victim(shard_t *sh, evict_lists_t *l) {
+    for (size_t n = 0; n < 4 * (l->count[S3_SMALL] + l->count[S3_MAIN]) + 1; n++) {
+        size_t total = l->count[S3_SMALL] + l->count[S3_MAIN];
+        cache_entry_t *entry = l->tail[S3_SMALL];
+        if (entry && (l->count[S3_SMALL] > total * S3_SMALL_PCT / 100 || !l->tail[S3_MAIN])) {
+            if (hits_of(entry)) {
+                evict_move(l, entry, S3_MAIN);
+                continue;
+            }
+            sh->ghost[entry->hv & (GHOST_SIZE - 1)] = entry->hv;
+            return entry;
+        }
+
+        entry = l->tail[S3_MAIN];
+        if (!entry) return NULL;
+        uint8_t hits = hits_of(entry);
+        if (!hits) return entry;
+        evict_unlink(l, entry);
+        __atomic_store_n(&entry->hits, hits - 1, __ATOMIC_RELAXED);
+        evict_push(l, entry, S3_MAIN);
+    }
+    return l->tail[S3_MAIN] ? l->tail[S3_MAIN] : l->tail[S3_SMALL];
+}
+
+/* -e tinylfu: W-TinyLFU. new entries go through a small LRU window; the
+ * main cache is a segmented LRU of probation and protected. an entry
+ * leaving the window only gets into main if a count-min sketch of access
+ * frequencies rates it above main's own victim. hits are counted in the
+ * entry and folded into the sketch whenever a writer moves it, so reads
+ * never write to the shared sketch.
+ */
+#define TLFU_WINDOW 0
+#define TLFU_PROBATION 1
+#define TLFU_PROTECTED 2
+#define TLFU_WINDOW_PCT 1
+#define TLFU_PROTECTED_PCT 80
+#define TLFU_HITS_MAX 15
+#define SKETCH_WIDTH 4096   // counters per row, per shard
+#define SKETCH_DEPTH 4
+
+typedef struct sketch {
+    uint8_t counts[SKETCH_DEPTH][SKETCH_WIDTH];
+    size_t adds;            // halve everything every 10 * SKETCH_WIDTH
+} sketch_t;
+
+static inline size_t sketch_index(uint32_t hv, int row) {
+    static const uint32_t seeds[SKETCH_DEPTH] = {
+        0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f,
+    };
+    return (uint32_t)(hv * seeds[row]) >> 20; // log2(SKETCH_WIDTH) bits
+}
+
+void sketch_add(sketch_t *s, uint32_t hv, unsigned n) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t *c = &s->counts[row][sketch_index(hv, row)];
+        *c = *c + n > 15 ? 15 : *c + n;
+    }
+    if (++s->adds >= 10 * SKETCH_WIDTH) {
+        // age the counts so yesterday's favourites can be displaced
+        for (int row = 0; row < SKETCH_DEPTH; row++)
+            for (size_t i = 0; i < SKETCH_WIDTH; i++) s->counts[row][i] >>= 1;
+        s->adds = 0;
+    }
+}
+
+unsigned sketch_estimate(sketch_t *s, uint32_t hv) {
+    unsigned est = 15;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned c = s->counts[row][sketch_index(hv, row)];
+        if (c < est) est = c;
+    }
+    return est;
+}
+
+/* hand the entry's hits over to the sketch */
+void tinylfu_fold(shard_t *sh, cache_entry_t *entry) {
+    uint8_t hits = hits_of(entry);
+    if (!hits) return;
+    sketch_add(sh->sketch, entry->hv, hits);
+    __atomic_store_n(&entry->hits, 0, __ATOMIC_RELAXED);
+}
+
+void tinylfu_touch(cache_entry_t *entry) {
+    hits_bump(entry, TLFU_HITS_MAX);
+}
+
+void tinylfu_insert(shard_t *sh, evict_lists_t *l, cache_entry_t *entry) {
+    // a store is an access too
+    sketch_add(sh->sketch, entry->hv, 1);
+    evict_push(l, entry, TLFU_WINDOW);
+
+    // until memory runs out everything is admitted
+    size_t total = l->count[TLFU_WINDOW] + l->count[TLFU_PROBATION] + l->count[TLFU_PROTECTED];
+    size_t window = total * TLFU_WINDOW_PCT / 100;
+    while (l->count[TLFU_WINDOW] > (window ? window : 1)) {
+        cache_entry_t *e = l->tail[TLFU_WINDOW];
+        tinylfu_fold(sh, e);
+        evict_move(l, e, TLFU_PROBATION);
+    }
+}
+
+cache_entry_t *tinylfu_victim(shard_t *sh, evict_lists_t *l) {
+    // probation entries that were hit earn protection, and protected
+    // overflow goes back on probation
+    for (int i = 0; i < 8 && l->tail[TLFU_PROBATION] && hits_of(l->tail[TLFU_PROBATION]); i++) {
+        cache_entry_t *entry = l->tail[TLFU_PROBATION];
+        tinylfu_fold(sh, entry);
+        evict_move(l, entry, TLFU_PROTECTED);
+    }
+    size_t main = l->count[TLFU_PROBATION] + l->count[TLFU_PROTECTED];
+    while (l->count[TLFU_PROTECTED] > main * TLFU_PROTECTED_PCT / 100) {
+        cache_entry_t *entry = l->tail[TLFU_PROTECTED];
+        tinylfu_fold(sh, entry);
+        evict_move(l, entry, TLFU_PROBATION);
+    }
+
+    cache_entry_t *victim = l->tail[TLFU_PROBATION] ? l->tail[TLFU_PROBATION]
+                                                    : l->tail[TLFU_PROTECTED];
+    cache_entry_t *candidate = l->tail[TLFU_WINDOW];
+    if (!candidate) return victim;
+    if (!victim) return candidate;
+
+    // admission: the oldest of the window against main's victim
+    tinylfu_fold(sh, candidate);
+    tinylfu_fold(sh, victim);
+    if (sketch_estimate(sh->sketch, candidate->hv) > sketch_estimate(sh->sketch, victim->hv)) {
+        evict_move(l, candidate, TLFU_PROBATION);
+        return victim;
+    }
+    return candidate;
+}
+
+const evict_policy_t evict_policies[] = {
+    [EVICT_LRU]     = { "lru", lru_touch, lru_insert, lru_victim },
+    [EVICT_CLOCK]   = { "clock", clock_touch, clock_insert, clock_victim },
+    [EVICT_S3FIFO]  = { "s3fifo", s3fifo_touch, s3fifo_insert, s3fifo_victim },
+    [EVICT_TINYLFU] = { "tinylfu", tinylfu_touch, tinylfu_insert, tinylfu_victim },
+};
+const evict_policy_t *policy = &evict_policies[EVICT_LRU];
+
+void evict_init(void) {
+    policy = &evict_policies[settings.evict];
+    for (unsigned i = 0; i <= shard_mask; i++) {
+        if (settings.evict == EVICT_S3FIFO)
+            shards[i].ghost = calloc(GHOST_SIZE, sizeof(uint32_t));
+        if (settings.evict == EVICT_TINYLFU)
+            shards[i].sketch = calloc(1, sizeof(sketch_t));
+        if ((settings.evict == EVICT_S3FIFO && !shards[i].ghost) ||
+            (settings.evict == EVICT_TINYLFU && !shards[i].sketch)) {
+            perror("evict");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* expiry */
+
+#define REALTIME_MAXDELTA (60 * 60 * 24 * 30) // longer exptimes are unix times
+#define TIMER_INTERVAL_MS 100
+
+/* a protocol exptime in current_secs(); one already past expires at once */
+uint32_t exptime_to_secs(uint32_t exptime) {
+    if (!exptime) return 0;
+    uint32_t now = current_secs();
+    if (exptime <= REALTIME_MAXDELTA) return now + exptime;
+    time_t wall = time(NULL);
+    return (time_t)exptime > wall ? now + (uint32_t)(exptime - wall) : now;
+}
+
+/* FLUSH. every entry is stamped when linked in with the generation of
+ * the whole cache plus that of its key's namespace, and is dead as soon as
+ * either moves on, so a flush is a counter bump however many keys it
+ * drops. the namespace of a key is what comes before its first NS_DELIM;
+ * namespaces hash to NS_SLOTS slots, 0 being for keys outside any.
+ */
+#define NS_SLOTS 4096
+#define NS_DELIM ':'
+#define CRAWL_STEP 1024 // buckets or slots the crawler looks at per shard and tick
+
+uint32_t flush_gen;
+uint32_t ns_gen[NS_SLOTS];
+uint32_t flush_at;              // a delayed FLUSH of everything is due, or 0
+uint32_t ns_flush_at[NS_SLOTS]; // and of a namespace
+uint32_t flush_seq;             // flushes that took effect, for the crawler
+
+/* the slot of the namespace named by the first len bytes of name */
+static inline uint16_t ns_slot(const uint8_t *name, size_t len) {
+    return 1 + KEY_HASH(name, len) % (NS_SLOTS - 1);
+}
+
+static inline uint16_t key_ns(const uint8_t *key, size_t len) {
+    const uint8_t *delim = memchr(key, NS_DELIM, len);
+    return delim ? ns_slot(key, delim - key) : 0;
+}
+
+static inline uint32_t entry_gen(uint16_t ns) {
+    return __atomic_load_n(&flush_gen, __ATOMIC_RELAXED) +
+           __atomic_load_n(&ns_gen[ns], __ATOMIC_RELAXED);
+}
+
+void flush_bump(uint32_t *gen) {
+    __atomic_add_fetch(gen, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&flush_seq, 1, __ATOMIC_RELEASE);
+}
+
+/* carry out the delayed flushes that are due; from the timer thread */
+void flush_due(uint32_t now) {
+    uint32_t at = __atomic_load_n(&flush_at, __ATOMIC_RELAXED);
+    if (at && at <= now && __atomic_compare_exchange_n(&flush_at, &at, 0, 0, __ATOMIC_RELAXED,
+                                                       __ATOMIC_RELAXED))
+        flush_bump(&flush_gen);
+    for (unsigned i = 1; i < NS_SLOTS; i++) {
+        at = __atomic_load_n(&ns_flush_at[i], __ATOMIC_RELAXED);
+        if (at && at <= now && __atomic_compare_exchange_n(&ns_flush_at[i], &at, 0, 0,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            flush_bump(&ns_gen[i]);
+    }
+}
+
+/* expired, or flushed */
+static inline int entry_expired(cache_entry_t *entry, uint32_t now) {
+    return (entry->exptime && entry->exptime <= now) || entry->gen != entry_gen(entry->ns);
+}
+
+/* the wheel functions are called with sh->lock held */
+void wheel_link(cache_entry_t **slot, cache_entry_t *entry) {
+    entry->tnext = *slot;
+    if (*slot) (*slot)->tpprev = &entry->tnext;
+    entry->tpprev = slot;
+    *slot = entry;
+}
+
+void wheel_add(wheel_t *w, cache_entry_t *entry) {
+    uint32_t t = entry->exptime;
+    if (t <= w->now) t = w->now + 1; // overdue; the next tick takes it
+    uint32_t delta = t - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1))) level++;
+    // past the wheel's reach it waits in the furthest slot, then goes round again
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) t = w->now + (1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    wheel_link(&w->slots[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)], entry);
+}
+
+void wheel_del(cache_entry_t *entry) {
+    if (!entry->tpprev) return;
+    *entry->tpprev = entry->tnext;
+    if (entry->tnext) entry->tnext->tpprev = entry->tpprev;
+    entry->tpprev = NULL;
+}
+
+/* empty a slot, returning what was in it */
+cache_entry_t *wheel_take(cache_entry_t **slot) {
+    cache_entry_t *list = *slot;
+    *slot = NULL;
+    for (cache_entry_t *e = list; e; e = e->tnext) e->tpprev = NULL;
+    return list;
+}
+
+/* the next CAS of a shard: increasing per shard, with the shard number
+ * in the low bits so no two shards hand out the same one
+ */
+static inline uint64_t next_cas(shard_t *sh) {
+    return ++sh->cas_seq << shard_bits | (uint64_t)(sh - shards);
+}
+
+/* the eviction lists an entry is on: those of its class, or for a
+ * chunked one those of the value chunks that make up most of it
+ */
+static inline evict_lists_t *entry_lists(shard_t *sh, cache_entry_t *entry) {
+    return &sh->lists[entry->chunked ? vchunk_class : entry->slab_class];
+}
+
+/* publish a fully built entry. call with sh->lock held */
+void insert_entry(shard_t *sh, cache_entry_t *entry) {
+    entry->cas = next_cas(sh);
+    entry->ns = key_ns(entry_key(entry), entry->key_len);
+    entry->gen = entry_gen(entry->ns);
+    if (settings.index == INDEX_SWISS) swiss_insert(sh, entry);
+    else chain_insert(sh, entry);
+    sh->count++;
+
+    policy->insert(sh, entry_lists(sh, entry), entry);
+    if (entry->exptime) wheel_add(&sh->wheel, entry);
+}
+
+/* unlink entry; the caller retires it. call with sh->lock held */
+void remove_entry(shard_t *sh, cache_entry_t *entry) {
+    if (settings.index == INDEX_SWISS) swiss_remove(sh, entry);
+    else chain_remove(sh, entry);
+    sh->count--;
+
+    evict_unlink(entry_lists(sh, entry), entry);
+    wheel_del(entry);
+}
+
+/* link entry in place of old, which has the same key; the caller retires
+ * old. call with sh->lock held
+ */
+void replace_entry(shard_t *sh, cache_entry_t *old, cache_entry_t *entry) {
+    entry->cas = next_cas(sh);
+    entry->ns = key_ns(entry_key(entry), entry->key_len);
+    entry->gen = entry_gen(entry->ns);
+    if (settings.index == INDEX_SWISS) swiss_replace(sh, old, entry);
+    else chain_replace(sh, old, entry);
+
+    evict_unlink(entry_lists(sh, old), old);
+    policy->insert(sh, entry_lists(sh, entry), entry);
+    wheel_del(old);
+    if (entry->exptime) wheel_add(&sh->wheel, entry);
+}
+
+/* run the shard's wheel up to now, unlinking and retiring what is due.
+ * on each tick the slots of coarser levels whose turn has come are
+ * spread over the finer ones first.
+ */
+void wheel_advance(shard_t *sh, uint32_t now) {
+    wheel_t *w = &sh->wheel;
+    while ((int32_t)(now - w->now) > 0) {
+        w->now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (w->now & ((1u << (WHEEL_BITS * level)) - 1)) break;
+            cache_entry_t *e = wheel_take(&w->slots[level][(w->now >> (WHEEL_BITS * level)) &
+                                                           (WHEEL_SLOTS - 1)]);
+            while (e) {
+                cache_entry_t *next = e->tnext;
+                // due this very tick: straight into the slot expired below
+                if (e->exptime <= w->now) wheel_link(&w->slots[0][w->now & (WHEEL_SLOTS - 1)], e);
+                else wheel_add(w, e);
+                e = next;
+            }
+        }
+
+        cache_entry_t *e = wheel_take(&w->slots[0][w->now & (WHEEL_SLOTS - 1)]);
+        while (e) {
+            cache_entry_t *next = e->tnext;
+            if (entry_expired(e, w->now)) {
+                remove_entry(sh, e);
+                epoch_retire(e, entry_retire);
+            } else {
+                wheel_add(w, e);
+            }
+            e = next;
+        }
+    }
+}
+
+/* look at the next n buckets (or slots) of the shard's index for entries
+ * a FLUSH killed and give them back, so memory is not left to eviction.
+ * a pass that ends has reclaimed all that flushes up to the one it started
+ * at left behind. call with sh->lock held
+ */
+void shard_crawl(shard_t *sh, size_t n) {
+    if (sh->old_table || sh->old_swiss) return; // moved first, a step per tick
+    void *index = settings.index == INDEX_SWISS ? (void *)sh->swiss : (void *)sh->table;
+    if (!sh->crawl_pos || index != sh->crawl_index) {
+        sh->crawl_index = index;
+        sh->crawl_pos = 0;
+        sh->crawl_seq = __atomic_load_n(&flush_seq, __ATOMIC_ACQUIRE);
+    }
+
+    uint32_t now = current_secs();
+    size_t end = settings.index == INDEX_SWISS ? (sh->swiss->mask + 1) * GROUP_SIZE
+                                               : sh->table->mask + 1;
+    for (; n && sh->crawl_pos < end; n--, sh->crawl_pos++) {
+        cache_entry_t *e;
+        if (settings.index == INDEX_SWISS) {
+            if (sh->swiss->ctrl[sh->crawl_pos] & 0x80) continue;
+            e = sh->swiss->slots[sh->crawl_pos].entry;
+            if (entry_expired(e, now)) {
+                remove_entry(sh, e);
+                epoch_retire(e, entry_retire);
+            }
+            continue;
+        }
+        for (e = sh->table->buckets[sh->crawl_pos]; e;) {
+            cache_entry_t *next = e->next;
+            if (entry_expired(e, now)) {
+                remove_entry(sh, e);
+                epoch_retire(e, entry_retire);
+            }
+            e = next;
+        }
+    }
+    if (sh->crawl_pos == end) {
+        sh->crawled = sh->crawl_seq;
+        sh->crawl_pos = 0;
+    }
+}
+
+/* evict whatever item holds a chunk of a page being drained. the header
+ * read may be stale or half written; the item only counts once found
+ * linked under its shard's lock, and a wrong guess merely misses it
+ */
+void drain_chunk(slab_page_t *page, void *p) {
+    cache_entry_t *e = page->cls == vchunk_class ? ((vchunk_t *)p)->owner : p;
+    if (!e) return;
+    uint32_t hv = e->hv;
+    uint16_t key_len = e->key_len;
+    if (entry_key(e) + key_len > (uint8_t *)page_of(e) + SLAB_PAGE_SIZE) return;
+
+    shard_t *sh = shard_for(hv);
+    pthread_mutex_lock(&sh->lock);
+    int linked = find_entry(sh, (char *)entry_key(e), key_len, hv) == e;
+    if (linked) remove_entry(sh, e);
+    pthread_mutex_unlock(&sh->lock);
+    if (linked) epoch_retire(e, entry_retire);
+}
+
+void drain_page(slab_page_t *page) {
+    for (uint32_t i = 0; i < page->carved; i++) drain_chunk(page, page_chunk(page, i));
+}
+
+/* give up a page of node's class with the most, so that another may be
+ * mapped: evict every item on it and let it go to the pool once its chunks
+ * are back. it stops counting against the limit at once, so the limit is
+ * overshot by the pages still draining. this locks every shard of the
+ * node, but only once for each page moved. returns 0 if none can go.
+ */
+int slab_drain(unsigned node) {
+    slab_node_t *sn = &slab_nodes[node];
+    if (__atomic_load_n(&sn->ndraining, __ATOMIC_RELAXED) >= SLAB_DRAIN_MAX) return 0;
+    unsigned cls = 0;
+    size_t most = 0;
+    for (unsigned i = 1; i < num_slab_classes; i++) {
+        size_t n = __atomic_load_n(&slabs[node][i].npages, __ATOMIC_RELAXED);
+        if (n > most) {
+            most = n;
+            cls = i;
+        }
+    }
+    if (!cls) return 0;
+
+    // the page with the most chunks back already has the fewest items
+    slab_class_t *sc = &slabs[node][cls];
+    pthread_mutex_lock(&sc->lock);
+    slab_page_t **best = NULL;
+    for (slab_page_t **pp = &sc->pages; *pp; pp = &(*pp)->next)
+        if (!best || (*pp)->nfree >= (*best)->nfree) best = pp;
+    if (!best) {
+        pthread_mutex_unlock(&sc->lock);
+        return 0;
+    }
+    slab_page_t *page = *best;
+    *best = page->next;
+    __atomic_store_n(&sc->npages, sc->npages - 1, __ATOMIC_RELAXED);
+    if (page->partial) {
+        slab_page_t **pp = &sc->partial;
+        while (*pp != page) pp = &(*pp)->pnext;
+        *pp = page->pnext;
+        page->partial = 0;
+    }
+    __atomic_store_n(&page->draining, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mem_used, SLAB_PAGE_SIZE, __ATOMIC_RELAXED);
+    int empty = page->nfree == page_chunks(cls);
+    pthread_mutex_lock(&sn->lock);
+    page->dnext = sn->draining;
+    sn->draining = page;
+    sn->ndraining++;
+    page->pins = !empty;
+    pthread_mutex_unlock(&sn->lock);
+    if (empty) page_release(node, page);
+    pthread_mutex_unlock(&sc->lock);
+    if (empty) return 1;
+
+    // its chunks the shards keep free come back first
+    for (unsigned i = 0; i <= shard_mask; i++) {
+        shard_t *sh = &shards[i];
+        if (sh->node != node) continue;
+        pthread_mutex_lock(&sh->slab_lock);
+        for (void **pp = &sh->free[cls]; *pp;) {
+            void *p = *pp;
+            if (page_of(p) != page) {
+                pp = (void **)p;
+                continue;
+            }
+            *pp = *(void **)p;
+            sh->nfree[cls]--;
+            page_free(node, cls, p);
+        }
+        pthread_mutex_unlock(&sh->slab_lock);
+    }
+    drain_page(page);
+    page_unpin(node, page);
+    return 1;
+}
+
+/* go over the pages still draining again: a store may have had a chunk of
+ * one in hand when it started, and linked its item since. they are pinned
+ * while we look, so none can go to the pool and be carved for another
+ * class under us. timer thread only
+ */
+void slab_drain_tick(void) {
+    for (unsigned node = 0; node < num_nodes; node++) {
+        slab_node_t *sn = &slab_nodes[node];
+        slab_page_t *pages[SLAB_DRAIN_MAX];
+        unsigned n = 0;
+        pthread_mutex_lock(&sn->lock);
+        for (slab_page_t *page = sn->draining; page && n < SLAB_DRAIN_MAX; page = page->dnext) {
+            page->pins++;
+            pages[n++] = page;
+        }
+        pthread_mutex_unlock(&sn->lock);
+        for (unsigned i = 0; i < n; i++) {
+            drain_page(pages[i]);
+            page_unpin(node, pages[i]);
+        }
+    }
+}
+
+/* expires entries in the background. GETs never see an expired entry
+ * anyway; this gives their memory back without anyone walking the table.
+ */
+void *timer_thread(void *arg) {
+    (void)arg;
+    epoch_register();
+    while (1) {
+        uint32_t now = current_secs();
+        flush_due(now);
+        uint32_t seq = __atomic_load_n(&flush_seq, __ATOMIC_ACQUIRE);
+        for (unsigned i = 0; i <= shard_mask; i++) {
+            shard_t *sh = &shards[i];
+            // only we move the wheel and crawl; a resize is just a hint
+            // until locked
+            if (sh->wheel.now == now && sh->crawled == seq &&
+                !__atomic_load_n(&sh->old_table, __ATOMIC_RELAXED) &&
+                !__atomic_load_n(&sh->old_swiss, __ATOMIC_RELAXED))
+                continue;
+            pthread_mutex_lock(&sh->lock);
+            wheel_advance(sh, now);
+            index_migrate(sh, MIGRATE_IDLE_STEP);
+            if (sh->crawled != seq) shard_crawl(sh, CRAWL_STEP);
+            pthread_mutex_unlock(&sh->lock);
+        }
+        slab_drain_tick();
+        epoch_reclaim();
+        epoch_reclaim_others();
+        usleep(TIMER_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+/* evict an entry of class cls from the shard. its chunk comes back to the
+ * shard once readers have moved on, which the reclaiming between the tries
+ * of item_alloc mostly sees to. returns 0 if the shard has none of it.
+ */
+int evict_one(shard_t *sh, unsigned cls) {
+    pthread_mutex_lock(&sh->lock);
+    cache_entry_t *victim = policy->victim(sh, &sh->lists[cls]);
+    if (victim) remove_entry(sh, victim);
+    pthread_mutex_unlock(&sh->lock);
+    if (!victim) return 0;
+
+    epoch_retire(victim, entry_retire);
+    epoch_reclaim();
+    return 1;
+}
+
+void *large_alloc(size_t size) {
+    if (!mem_reserve(size)) return NULL;
+    void *p = malloc(size);
+    if (!p) __atomic_sub_fetch(&mem_used, size, __ATOMIC_RELAXED);
+    return p;
+}
+
+/* whether the lists hold anything, read without the shard lock */
+static inline int lists_any(evict_lists_t *l) {
+    for (int seg = 0; seg < EVICT_SEGS; seg++)
+        if (__atomic_load_n(&l->count[seg], __ATOMIC_RELAXED)) return 1;
+    return 0;
+}
+
+/* make room for an entry of class cls in the shard: evict one of its
+ * class there, or in another shard of the node that seems to have one, or
+ * failing that have a page of some class drained. the other shards are
+ * tried in turn from a cursor, and locked only if they look worth it
+ */
+int evict_for(shard_t *sh, unsigned cls) {
+    static unsigned cursor;
+    if (evict_one(sh, cls)) return 1;
+    unsigned start = __atomic_fetch_add(&cursor, 1, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i <= shard_mask; i++) {
+        shard_t *other = &shards[(start + i) & shard_mask];
+        if (other != sh && other->node == sh->node && lists_any(&other->lists[cls]) &&
+            evict_one(other, cls))
+            return 1;
+    }
+    return slab_drain(sh->node);
+}
+
+/* a chunk of class cls for the shard, or for class 0 a block of size from
+ * malloc. once the memory limit is reached this evicts to make room. what
+ * it evicts may come back late while readers hold the epoch, so a try
+ * that finds nothing to evict only reclaims, and the last resort is a page
+ * drained, which counts as free at once. NULL if even that cannot be had
+ */
+void *item_alloc(shard_t *sh, unsigned cls, size_t size) {
+    for (int tries = 0;; tries++) {
+        void *p = cls ? slab_alloc(sh, cls) : large_alloc(size);
+        if (p || tries > EVICT_TRIES) return p;
+        if (tries == EVICT_TRIES) slab_drain(sh->node);
+        else if (!evict_for(sh, cls)) epoch_reclaim();
+    }
+}
+
+/* a fresh, unlinked entry with room for the key and value; the caller
+ * fills both in
+ */
+cache_entry_t *entry_alloc(uint32_t hv, size_t key_len, size_t len) {
+    size_t size = entry_size(key_len, len);
+    unsigned cls = slab_class_for(size);
+    shard_t *sh = shard_for(hv);
+
+    cache_entry_t *entry = item_alloc(sh, cls, size);
+    if (!entry) return NULL;
+    entry->next = NULL;
+    entry->refcount = 1;
+    entry->hv = hv;
+    entry->slab_class = cls;
+    entry->hits = 0;
+    entry->chunked = 0;
+    entry->counter = 0;
+    entry->atime = 0;
+    entry->flags = 0;
+    entry->exptime = 0;
+    entry->tpprev = NULL;
+    entry->key_len = key_len;
+    entry->len = len;
+    return entry;
+}
+
+/* count value chunks linked through next. NULL if there is no room */
+vchunk_t *vchunks_alloc(shard_t *sh, size_t count) {
+    vchunk_t *list = NULL;
+    while (count--) {
+        vchunk_t *chunk = item_alloc(sh, vchunk_class, 0);
+        if (!chunk) {
+            vchunks_free(sh, list);
+            return NULL;
+        }
+        chunk->next = list;
+        list = chunk;
+    }
+    return list;
+}
+
+/* an entry for a chunked value of len bytes, with its chunks linked up
+ * but empty; vchunks_fill writes them front to back
+ */
+cache_entry_t *entry_alloc_chunked(uint32_t hv, size_t key_len, size_t len) {
+    cache_entry_t *entry = entry_alloc(hv, key_len, sizeof(vchunks_t));
+    if (!entry) return NULL;
+    vchunk_t *chunks = vchunks_alloc(shard_for(hv), (len + vchunk_cap - 1) / vchunk_cap);
+    if (len && !chunks) {
+        entry_release(entry);
+        return NULL;
+    }
+    for (vchunk_t *chunk = chunks; chunk; chunk = chunk->next) chunk->owner = entry;
+    vchunks_t *d = entry_chunks(entry);
+    memset(d, 0, sizeof(*d));
+    d->head = d->tail = chunks;
+    entry->chunked = 1;
+    entry->len = len;
+    return entry;
+}
+
+/* where the next bytes of a chunked value being built go, and how many
+ * fit in that chunk
+ */
+uint8_t *vchunks_dest(cache_entry_t *entry, size_t *room) {
+    vchunks_t *d = entry_chunks(entry);
+    if (d->tail_used == vchunk_cap) {
+        d->tail = d->tail->next;
+        d->tail_used = 0;
+    }
+    *room = vchunk_cap - d->tail_used;
+    return d->tail->data + d->tail_used;
+}
+
+void vchunks_fill(cache_entry_t *entry, const uint8_t *src, size_t n) {
+    while (n > 0) {
+        size_t room;
+        uint8_t *dst = vchunks_dest(entry, &room);
+        if (room > n) room = n;
+        memcpy(dst, src, room);
+        entry_chunks(entry)->tail_used += room;
+        src += room;
+        n -= room;
+    }
+}
+
+static inline vchunk_t *vchunks_take(cache_entry_t *entry, vchunk_t **spare) {
+    vchunk_t *chunk = *spare;
+    *spare = chunk->next;
+    chunk->next = NULL;
+    chunk->owner = entry;
+    return chunk;
+}
+
+/* add n bytes at the end of a chunked value, filling its last chunk and
+ * linking chunks from spare behind it. readers only learn of the bytes
+ * from the new length, stored last. call with the shard lock held if the
+ * entry is linked.
+ */
+void vchunks_append(cache_entry_t *entry, const uint8_t *src, size_t n, vchunk_t **spare) {
+    vchunks_t *d = entry_chunks(entry);
+    uint32_t len = entry->len + n;
+
+    while (n > 0) {
+        if (!d->tail || d->tail_used == vchunk_cap) {
+            vchunk_t *chunk = vchunks_take(entry, spare);
+            if (d->tail) __atomic_store_n(&d->tail->next, chunk, __ATOMIC_RELAXED);
+            else d->head = chunk;
+            d->tail = chunk;
+            d->tail_used = 0;
+        }
+        size_t take = vchunk_cap - d->tail_used;
+        if (take > n) take = n;
+        memcpy(d->tail->data + d->tail_used, src, take);
+        d->tail_used += take;
+        src += take;
+        n -= take;
+    }
+    __atomic_store_n(&entry->len, len, __ATOMIC_RELEASE);
+}
+
+/* add n bytes in front of a chunked value, filling its first chunk from
+ * the back and linking chunks from spare before it, then move the front
+ * under the seqlock. call with the shard lock held
+ */
+void vchunks_prepend(cache_entry_t *entry, const uint8_t *src, size_t n, vchunk_t **spare) {
+    vchunks_t *d = entry_chunks(entry);
+    vchunk_t *head = d->head;
+    uint32_t off = d->head_off;
+
+    for (size_t left = n; left > 0;) {
+        if (off == 0) {
+            vchunk_t *chunk = vchunks_take(entry, spare);
+            chunk->next = head;
+            head = chunk;
+            off = vchunk_cap;
+        }
+        size_t take = off < left ? off : left;
+        memcpy(head->data + off - take, src + left - take, take);
+        off -= take;
+        left -= take;
+    }
+
+    __atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->head, head, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->head_off, off, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->len, entry->len + n, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* call fn on every entry of a shard. call with sh->lock held */
+void shard_foreach(shard_t *sh, void (*fn)(cache_entry_t *, void *), void *arg) {
+    if (settings.index == INDEX_SWISS) {
+        swiss_t *tables[2] = { sh->swiss, sh->old_swiss };
+        for (int k = 0; k < 2 && tables[k]; k++)
+            for (size_t i = 0; i < (tables[k]->mask + 1) * GROUP_SIZE; i++)
+                if (!(tables[k]->ctrl[i] & 0x80)) fn(tables[k]->slots[i].entry, arg);
+        return;
+    }
+    // buckets of the old table that were moved are empty
+    table_t *tables[2] = { sh->table, sh->old_table };
+    for (int k = 0; k < 2 && tables[k]; k++)
+        for (size_t b = 0; b <= tables[k]->mask; b++)
+            for (cache_entry_t *entry = tables[k]->buckets[b]; entry; entry = entry->next)
+                fn(entry, arg);
+}
+
+/* quiet commands only answer when something went wrong (or, for the
+ * GETs, when they hit); the client finds out the rest from the NOOP that
+ * ends its batch.
+ */
+int is_quiet(uint8_t opcode) {
+    switch (opcode) {
+        case CMD_GETQ:
+        case CMD_GETKQ:
+        case CMD_SETQ:
+        case CMD_ADDQ:
+        case CMD_DELETEQ:
+        case CMD_INCREMENTQ:
+        case CMD_DECREMENTQ:
+        case CMD_APPENDQ:
+        case CMD_PREPENDQ:
+        case CMD_FLUSHQ:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* write a response header echoing the request's opcode and opaque */
+void write_header(conn_t *c, memcache_req_header_t *req, uint16_t status,
+                  uint8_t extras_len, uint16_t key_len, uint32_t body_len, uint64_t cas) {
+    memcache_req_header_t resp = {
+        .magic = 0x81,
+        .opcode = req->opcode,
+        .key_length = htons(key_len),
+        .extras_length = extras_len,
+        .vbucket_id = htons(status),
+        .total_body_length = htonl(body_len),
+        .opaque = req->opaque,
+        .cas = htobe64(cas),
+    };
+    conn_write(c, &resp, sizeof(resp));
+}
+
+/* hot items. a GET that references a value writes its refcount, a line
+ * every worker reading the item shares, so those GETs are sampled into a
+ * space-saving top-k per worker. a key the top-k is sure has enough of
+ * them gets a copy private to the worker, which GETs send instead for as
+ * long as the item has the CAS it was copied at: a SET or DELETE changes
+ * that, and a GET finding the copy stale frees it. so do the top-k
+ * rotations for copies no GET used since the last one, so copies of keys
+ * gone cold or deleted don't hold on to memory under -m.
+ * chunked values can grow in place and are not copied.
+ */
+#define HOT_SAMPLE 16  // one referencing GET in this many is counted
+#define HOT_TOPK 32
+#define HOT_WINDOW 1024 // samples between halving every count
+#define HOT_MIN 32      // count, less the error, that makes a key hot
+
+typedef struct hot {
+    unsigned tick;
+    unsigned samples;
+    struct {
+        uint32_t hv;
+        uint32_t count;     // 0 = free
+        uint32_t err;       // at most this much of count is another key's
+    } top[HOT_TOPK];
+    cache_entry_t *copies[]; // settings.hot_copies, by hash
+} hot_t;
+
+__thread hot_t *my_hot;
+
+/* free the copies unused since the last rotation. a copy is private to
+ * the worker and on no eviction list, so its hits just mark it used
+ */
+void hot_expire(hot_t *h) {
+    for (unsigned i = 0; i < settings.hot_copies; i++) {
+        cache_entry_t *copy = h->copies[i];
+        if (!copy) continue;
+        if (copy->hits) {
+            copy->hits = 0;
+            continue;
+        }
+        entry_release(copy); // sends may still hold it
+        h->copies[i] = NULL;
+    }
+}
+
+/* count a referencing GET, copy or not; whether it is one to sample. the
+ * counts age, and unused copies go, as the samples come in
+ */
+int hot_tick(hot_t *h) {
+    if (++h->tick < HOT_SAMPLE) return 0;
+    h->tick = 0;
+    if (++h->samples == HOT_WINDOW) {
+        h->samples = 0;
+        for (int i = 0; i < HOT_TOPK; i++) {
+            h->top[i].count /= 2;
+            h->top[i].err /= 2;
+        }
+        hot_expire(h);
+    }
+    return 1;
+}
+
+/* count a sampled GET of hv; whether it is hot */
+int hot_sample(hot_t *h, uint32_t hv) {
+
+    int min = 0;
+    for (int i = 0; i < HOT_TOPK; i++) {
+        if (h->top[i].count && h->top[i].hv == hv) {
+            h->top[i].count++;
+            return h->top[i].count - h->top[i].err >= HOT_MIN;
+        }
+        if (h->top[i].count < h->top[min].count) min = i;
+    }
+    // it takes the place of the least counted, and may have had its hits
+    h->top[min].err = h->top[min].count;
+    h->top[min].count++;
+    h->top[min].hv = hv;
+    return 0;
+}
+
+/* what a GET of entry, which has the given CAS, should reference: this
+ * worker's copy of it, or the entry itself. call inside the epoch
+ */
+cache_entry_t *hot_copy(cache_entry_t *entry, uint64_t cas) {
+    if (!settings.hot_copies || entry->chunked) return entry;
+    hot_t *h = my_hot;
+    if (!h) {
+        h = my_hot = calloc(1, sizeof(hot_t) + settings.hot_copies * sizeof(cache_entry_t *));
+        if (!h) return entry;
+    }
+    int sampled = hot_tick(h);
+    cache_entry_t **slot = &h->copies[entry->hv % settings.hot_copies];
+    if (*slot && (*slot)->cas == cas) {
+        (*slot)->hits = 1;
+        return *slot;
+    }
+    if (*slot && (*slot)->hv == entry->hv) {
+        // most likely a copy of this key from before a store
+        entry_release(*slot);
+        *slot = NULL;
+    }
+    if (!sampled || !hot_sample(h, entry->hv)) return entry;
+
+    // only counters change in place, and they are too small to get here
+    size_t size = entry_size(entry->key_len, entry->len);
+    cache_entry_t *copy = large_alloc(size);
+    if (!copy) return entry;
+    memcpy(copy, entry, size);
+    copy->refcount = 1;
+    copy->slab_class = 0;
+    copy->cas = cas;
+    copy->hits = 1;
+    entry_release(*slot); // sends may still hold the old one
+    *slot = copy;
+    return copy;
+}
+
+/* GET, GETQ, GETK and GETKQ. the K variants echo the key back */
+void handle_get(conn_t *c, memcache_req_header_t *hdr, uint8_t *key, int with_key) {
+    uint16_t key_len = ntohs(hdr->key_length);
+    uint16_t resp_key_len = with_key ? key_len : 0;
+
+    uint32_t hv = key_hash(key, key_len);
+    shard_t *sh = shard_for(hv);
+
+    epoch_enter();
+    cache_entry_t *entry = lookup_entry(sh, (char *)key, key_len, hv);
+
+    // expired but not reaped yet is as good as gone
+    if (entry && entry_expired(entry, current_secs())) entry = NULL;
+
+    worker_stats_t *st = my_stats;
+    if (sh->node != st->node) stat_bump(&st->remote);
+    if (!entry) {
+        stat_bump(&st->misses);
+        epoch_exit();
+        if (!is_quiet(hdr->opcode)) write_header(c, hdr, RES_NOT_FOUND, 0, 0, 0, 0);
+        return;
+    }
+
+    stat_bump(&st->hits);
+    policy->touch(entry);
+
+    // entries are never modified and a SET only retires the old one, so
+    // this one stays intact until we leave the epoch. counters are the
+    // exception: read the CAS before the value an INCREMENT stores first.
+    // chunked values only grow, so the length read now is what we send
+    uint32_t flags = htonl(entry->flags);
+    uint64_t cas = __atomic_load_n(&entry->cas, __ATOMIC_ACQUIRE);
+    if (entry->counter == COUNTER_WORD) {
+        char text[COUNTER_DIGITS + 1];
+        size_t len = counter_text(entry, text);
+        epoch_exit();
+        write_header(c, hdr, RES_OK, sizeof(flags), resp_key_len,
+                     sizeof(flags) + resp_key_len + len, cas);
+        conn_write(c, &flags, sizeof(flags));
+        conn_write(c, key, resp_key_len);
+        conn_write(c, text, len);
+        return;
+    }
+    vchunk_t *chunk = NULL;
+    uint32_t off = 0;
+    uint32_t len = entry->chunked ? vchunks_snapshot(entry, &chunk, &off) : entry->len;
+    write_header(c, hdr, RES_OK, sizeof(flags), resp_key_len,
+                 sizeof(flags) + resp_key_len + len, cas);
+    conn_write(c, &flags, sizeof(flags));
+    conn_write(c, key, resp_key_len);
+    if (len >= REF_MIN) {
+        // keep it alive past the epoch while the value goes out
+        cache_entry_t *v = hot_copy(entry, cas);
+        entry_ref(v);
+        epoch_exit();
+        conn_write_value(c, v, len, chunk, off);
+        return;
+    }
+    if (chunk) conn_write_chunks(c, chunk, off, len);
+    else conn_write(c, entry_value(entry), len);
+    epoch_exit();
+}
+
+/* SET and SETQ. takes over the caller's reference to nv. with a nonzero
+ * CAS the store only goes through if the item still has that CAS.
+ */
+void handle_set(conn_t *c, memcache_req_header_t *hdr, cache_entry_t *nv) {
+    shard_t *sh = shard_for(nv->hv);
+    uint64_t want = be64toh(hdr->cas);
+
+    pthread_mutex_lock(&sh->lock);
+    cache_entry_t *old = find_entry(sh, (char *)entry_key(nv), nv->key_len, nv->hv);
+    if (want) {
+        uint16_t status = RES_OK;
+        if (!old || entry_expired(old, current_secs())) status = RES_NOT_FOUND;
+        else if (old->cas != want) status = RES_EXISTS;
+        if (status != RES_OK) {
+            pthread_mutex_unlock(&sh->lock);
+            entry_release(nv);
+            write_header(c, hdr, status, 0, 0, 0, 0);
+            return;
+        }
+    }
+    if (old) replace_entry(sh, old, nv);
+    else insert_entry(sh, nv);
+    uint64_t cas = nv->cas; // nv is the table's once we unlock
+    pthread_mutex_unlock(&sh->lock);
+
+    // readers may still be copying the old one
+    if (old) epoch_retire(old, entry_retire);
+
+    if (!is_quiet(hdr->opcode)) write_header(c, hdr, RES_OK, 0, 0, 0, cas);
+}
+
+/* ADD and ADDQ. takes over the caller's reference to nv */
+void handle_add(conn_t *c, memcache_req_header_t *hdr, cache_entry_t *nv) {
+    shard_t *sh = shard_for(nv->hv);
+
+    pthread_mutex_lock(&sh->lock);
+    cache_entry_t *old = find_entry(sh, (char *)entry_key(nv), nv->key_len, nv->hv);
+    if (old && !entry_expired(old, current_secs())) {
+        pthread_mutex_unlock(&sh->lock);
+        entry_release(nv);
+        write_header(c, hdr, RES_EXISTS, 0, 0, 0, 0);
+        return;
+    }
+
+    if (old) replace_entry(sh, old, nv);
+    else insert_entry(sh, nv);
+    uint64_t cas = nv->cas;
+    pthread_mutex_unlock(&sh->lock);
+
+    if (old) epoch_retire(old, entry_retire);
+
+    if (!is_quiet(hdr->opcode)) write_header(c, hdr, RES_OK, 0, 0, 0, cas);
+}
+
+void handle_delete(conn_t *c, memcache_req_header_t *hdr, uint8_t *key) {
+    uint16_t key_len = ntohs(hdr->key_length);
+
+    uint32_t hv = key_hash(key, key_len);
+    shard_t *sh = shard_for(hv);
+
+    pthread_mutex_lock(&sh->lock);
+    cache_entry_t *entry = find_entry(sh, (char *)key, key_len, hv);
+
+    if (!entry) {
+        pthread_mutex_unlock(&sh->lock);
+        write_header(c, hdr, RES_NOT_FOUND, 0, 0, 0, 0);
+        return;
+    }
+
+    int expired = entry_expired(entry, current_secs());
+    remove_entry(sh, entry);
+    pthread_mutex_unlock(&sh->lock);
+
+    // readers that found it before the unlink may still be using it
+    epoch_retire(entry, entry_retire);
+
+    if (expired) write_header(c, hdr, RES_NOT_FOUND, 0, 0, 0, 0);
+    else if (!is_quiet(hdr->opcode)) write_header(c, hdr, RES_OK, 0, 0, 0, 0);
+}
+
+/* one STAT answer; a final one without a key ends them */
+void write_stat(conn_t *c, memcache_req_header_t *hdr, const char *name, uint64_t value) {
+    char val[24];
+    size_t key_len = strlen(name), len = snprintf(val, sizeof(val), "%lu", value);
+    write_header(c, hdr, RES_OK, 0, key_len, key_len + len, 0);
+    conn_write(c, name, key_len);
+    conn_write(c, val, len);
+}
+
+/* STAT: GET hits, misses and remote accesses by the NUMA node of the
+ * workers serving them
+ */
+void handle_stat(conn_t *c, memcache_req_header_t *hdr) {
+    write_stat(c, hdr, "nodes", num_nodes);
+    for (unsigned node = 0; node < num_nodes; node++) {
+        uint64_t hits = 0, misses = 0, remote = 0;
+        for (int i = 0; i < settings.num_threads; i++) {
+            worker_stats_t *st = &worker_stats[i];
+            if (st->node != node) continue;
+            hits += __atomic_load_n(&st->hits, __ATOMIC_RELAXED);
+            misses += __atomic_load_n(&st->misses, __ATOMIC_RELAXED);
+            remote += __atomic_load_n(&st->remote, __ATOMIC_RELAXED);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "node%d_hits", node_ids[node]);
+        write_stat(c, hdr, name, hits);
+        snprintf(name, sizeof(name), "node%d_misses", node_ids[node]);
+        write_stat(c, hdr, name, misses);
+        snprintf(name, sizeof(name), "node%d_remote", node_ids[node]);
+        write_stat(c, hdr, name, remote);
+    }
+    write_header(c, hdr, RES_OK, 0, 0, 0, 0);
+}
+
+void handle_version(conn_t *c, memcache_req_header_t *req_hdr) {
+    const char *version = "C-Memcached 1.0";
+    size_t len = strlen(version);
+
+    write_header(c, req_hdr, RES_OK, 0, 0, len, 0);
+    conn_write(c, version, len);
+}
+
+void output_entry(cache_entry_t *entry, void *arg) {
+    struct timespec *ts = arg;
+
+    if (entry_expired(entry, current_secs())) return;
+    printf("%08lx:%08lx:", ts->tv_sec, ts->tv_nsec);
+    for (size_t i = 0; i < entry->key_len; i++)
+        printf("%02x", entry_key(entry)[i]);
+    printf(":");
+    if (entry->chunked) {
+        vchunks_t *d = entry_chunks(entry);
+        vchunk_t *chunk = d->head;
+        uint32_t off = d->head_off;
+        for (size_t len = entry->len, got; len > 0; len -= got) {
+            struct iovec iov[MAX_IOV];
+            int n = vchunks_iov(&chunk, &off, len, iov, MAX_IOV, &got);
+            for (int i = 0; i < n; i++)
+                for (size_t j = 0; j < iov[i].iov_len; j++)
+                    printf("%02x", ((uint8_t *)iov[i].iov_base)[j]);
+        }
+    } else {
+        char text[COUNTER_DIGITS + 1];
+        uint8_t *v = entry_value(entry);
+        size_t len = entry->len;
+        if (entry->counter == COUNTER_WORD) {
+            len = counter_text(entry, text);
+            v = (uint8_t *)text;
+        }
+        for (size_t i = 0; i < len; i++)
+            printf("%02x", v[i]);
+    }
+    printf("\n");
+}
+
+void handle_output(conn_t *c, memcache_req_header_t *req_hdr) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    for (unsigned s = 0; s <= shard_mask; s++) {
+        shard_t *sh = &shards[s];
+        pthread_mutex_lock(&sh->lock);
+        shard_foreach(sh, output_entry, &ts);
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    write_header(c, req_hdr, RES_OK, 0, 0, 0, 0);
+}
+
+void send_error_response(conn_t *c, memcache_req_header_t *req_hdr) {
+    write_header(c, req_hdr, RES_ERROR, 0, 0, 0, 0);
+}
+
+/* FLUSH: everything, or with a key only its namespace (the key up to its
+ * first NS_DELIM, or all of it); with an exptime, only once that comes.
+ * the entries flushed turn into misses at once and the crawler gives
+ * their memory back behind us.
+ */
+void handle_flush(conn_t *c, memcache_req_header_t *hdr, uint8_t *body) {
+    uint16_t key_len = ntohs(hdr->key_length);
+    if ((hdr->extras_length != 0 && hdr->extras_length != 4) ||
+        ntohl(hdr->total_body_length) != hdr->extras_length + (uint32_t)key_len) {
+        send_error_response(c, hdr);
+        return;
+    }
+
+    uint32_t when = 0;
+    if (hdr->extras_length) {
+        memcpy(&when, body, sizeof(when));
+        when = exptime_to_secs(ntohl(when));
+    }
+    uint32_t *gen = &flush_gen, *at = &flush_at;
+    if (key_len) {
+        uint8_t *key = body + hdr->extras_length;
+        uint8_t *delim = memchr(key, NS_DELIM, key_len);
+        uint16_t ns = ns_slot(key, delim ? (size_t)(delim - key) : key_len);
+        gen = &ns_gen[ns];
+        at = &ns_flush_at[ns];
+    }
+
+    // a later FLUSH replaces one still pending
+    __atomic_store_n(at, when, __ATOMIC_RELAXED);
+    if (!when) flush_bump(gen);
+    if (!is_quiet(hdr->opcode)) write_header(c, hdr, RES_OK, 0, 0, 0, 0);
+}
+
+/* INCREMENT, DECREMENT and their quiet forms, with extras of delta,
+ * initial value and exptime. a COUNTER_WORD is updated in place under the
+ * shard lock; a COUNTER_TEXT is replaced by a word, and a missing counter
+ * created as one with the initial value unless exptime is all ones. any
+ * other value is not a counter. a decrement stops at 0, an increment wraps.
+ */
+void handle_arith(conn_t *c, memcache_req_header_t *hdr, uint8_t *body) {
+    uint16_t key_len = ntohs(hdr->key_length);
+    if (hdr->extras_length != 20 || ntohl(hdr->total_body_length) != 20u + key_len) {
+        send_error_response(c, hdr);
+        return;
+    }
+
+    uint64_t delta, initial;
+    uint32_t exptime;
+    memcpy(&delta, body, sizeof(delta));
+    memcpy(&initial, body + 8, sizeof(initial));
+    memcpy(&exptime, body + 16, sizeof(exptime));
+    delta = be64toh(delta);
+    exptime = ntohl(exptime);
+    uint8_t *key = body + 20;
+    int incr = hdr->opcode == CMD_INCREMENT || hdr->opcode == CMD_INCREMENTQ;
+    uint64_t want = be64toh(hdr->cas);
+
+    uint32_t hv = key_hash(key, key_len);
+    shard_t *sh = shard_for(hv);
+    cache_entry_t *nv = NULL;
+    uint16_t status = RES_OK;
+    uint64_t value = initial; // network byte order, as stored and answered
+    uint64_t cas = 0;
+
+    uint64_t seen = 0; // CAS of the item nv was allocated for; 0 if none
+
+    while (1) {
+        pthread_mutex_lock(&sh->lock);
+        cache_entry_t *found = find_entry(sh, (char *)key, key_len, hv);
+        cache_entry_t *old = found && !entry_expired(found, current_secs()) ? found : NULL;
+        if (old && want && old->cas != want) status = RES_EXISTS;
+        else if (old && old->counter != COUNTER_WORD && old->counter != COUNTER_TEXT)
+            status = RES_DELTA_BADVAL;
+        else if (!old && (want || exptime == 0xffffffff)) status = RES_NOT_FOUND;
+        if (status != RES_OK) {
+            pthread_mutex_unlock(&sh->lock);
+            break;
+        }
+
+        if (old && old->counter == COUNTER_WORD) {
+            uint64_t v = be64toh(*entry_counter(old));
+            v = incr ? v + delta : v > delta ? v - delta : 0;
+            value = htobe64(v);
+            cas = next_cas(sh);
+            __atomic_store_n(entry_counter(old), value, __ATOMIC_RELAXED);
+            __atomic_store_n(&old->cas, cas, __ATOMIC_RELEASE);
+            policy->touch(old);
+            pthread_mutex_unlock(&sh->lock);
+            break;
+        }
+
+        if (nv && seen == (old ? old->cas : 0)) {
+            uint64_t v;
+            // marked a counter when stored, but not worth trusting blindly
+            if (old && parse_counter(entry_value(old), old->len, &v)) {
+                status = RES_DELTA_BADVAL;
+                pthread_mutex_unlock(&sh->lock);
+                break;
+            }
+            if (old) {
+                v = incr ? v + delta : v > delta ? v - delta : 0;
+                value = htobe64(v);
+                nv->flags = old->flags;
+                nv->exptime = old->exptime;
+            }
+            *entry_counter(nv) = value;
+            // an expired one not reaped yet goes too
+            if (found) replace_entry(sh, found, nv);
+            else insert_entry(sh, nv);
+            cas = nv->cas;
+            nv = NULL;
+            pthread_mutex_unlock(&sh->lock);
+            if (found) epoch_retire(found, entry_retire);
+            break;
+        }
+        seen = old ? old->cas : 0;
+        pthread_mutex_unlock(&sh->lock);
+
+        // allocating may evict, which takes shard locks. the item may
+        // change meanwhile; then seen no longer matches and we look again
+        entry_release(nv);
+        nv = entry_alloc(hv, key_len, sizeof(uint64_t));
+        if (!nv) {
+            status = RES_ENOMEM;
+            break;
+        }
+        memcpy(entry_key(nv), key, key_len);
+        nv->counter = COUNTER_WORD;
+        nv->exptime = exptime_to_secs(exptime);
+    }
+    // someone else got there while we allocated
+    entry_release(nv);
+
+    if (status != RES_OK) {
+        write_header(c, hdr, status, 0, 0, 0, 0);
+        return;
+    }
+    if (is_quiet(hdr->opcode)) return;
+    write_header(c, hdr, RES_OK, 0, 0, sizeof(value), cas);
+    conn_write(c, &value, sizeof(value));
+}
+
+/* APPEND, PREPEND and their quiet forms. a value that outgrows a value
+ * chunk is rebuilt chunked; from then on both only cost the bytes added,
+ * which go into free space at either end of the chunk list and into new
+ * chunks linked on, leaving everything a reader may be sending in place.
+ */
+void handle_concat(conn_t *c, memcache_req_header_t *hdr, uint8_t *body) {
+    uint16_t key_len = ntohs(hdr->key_length);
+    if (hdr->extras_length != 0) {
+        send_error_response(c, hdr);
+        return;
+    }
+
+    uint8_t *key = body;
+    uint8_t *src = body + key_len;
+    size_t n = ntohl(hdr->total_body_length) - key_len;
+    int prepend = hdr->opcode == CMD_PREPEND || hdr->opcode == CMD_PREPENDQ;
+    uint64_t want = be64toh(hdr->cas);
+
+    uint32_t hv = key_hash(key, key_len);
+    shard_t *sh = shard_for(hv);
+    uint16_t status = RES_OK;
+    uint64_t cas = 0;
+    char text[COUNTER_DIGITS + 1];
+
+    while (1) {
+        // size the item up, then allocate unlocked: evicting takes shard locks
+        pthread_mutex_lock(&sh->lock);
+        cache_entry_t *old = find_entry(sh, (char *)key, key_len, hv);
+        size_t old_len = 0;
+        if (!old || entry_expired(old, current_secs())) status = RES_NOT_STORED;
+        else if (want && old->cas != want) status = RES_EXISTS;
+        else {
+            old_len = old->counter == COUNTER_WORD ? counter_text(old, text) : old->len;
+            if (old_len + n > settings.item_max) status = RES_E2BIG;
+        }
+        if (status != RES_OK) {
+            pthread_mutex_unlock(&sh->lock);
+            break;
+        }
+        uint64_t seen = old->cas;
+        size_t len = old_len + n;
+        int chunked = old->chunked;
+        pthread_mutex_unlock(&sh->lock);
 
-cache_entry_t *find_entry(const char *key, size_t key_len) {
-    cache_entry_t *entry;
-    HASH_FIND(hh, cache_table, key, key_len, entry);
-    return entry;
+        cache_entry_t *nv = NULL;
+        vchunk_t *spare = NULL;
+        if (chunked) {
+            spare = vchunks_alloc(sh, (n + vchunk_cap - 1) / vchunk_cap);
+            if (n && !spare) status = RES_ENOMEM;
+        } else if (len > vchunk_cap) {
+            nv = entry_alloc_chunked(hv, key_len, len);
+            if (!nv) status = RES_ENOMEM;
+        } else {
+            nv = entry_alloc(hv, key_len, len);
+            if (!nv) status = RES_ENOMEM;
+        }
+        if (status != RES_OK) {
+            entry_release(nv);
+            vchunks_free(sh, spare);
+            break;
+        }
+
+        pthread_mutex_lock(&sh->lock);
+        old = find_entry(sh, (char *)key, key_len, hv);
+        if (!old || old->cas != seen || entry_expired(old, current_secs())) {
+            // changed while we were allocating; look again
+            pthread_mutex_unlock(&sh->lock);
+            entry_release(nv);
+            vchunks_free(sh, spare);
+            continue;
+        }
+
+        if (chunked) {
+            if (prepend) vchunks_prepend(old, src, n, &spare);
+            else vchunks_append(old, src, n, &spare);
+            cas = next_cas(sh);
+            __atomic_store_n(&old->cas, cas, __ATOMIC_RELEASE);
+            policy->touch(old);
+            pthread_mutex_unlock(&sh->lock);
+            vchunks_free(sh, spare);
+            break;
+        }
+
+        // old is small, so copying it out is cheap; a counter it may be
+        // only changes under the lock we hold, and is what text still has
+        uint8_t *old_value = old->counter == COUNTER_WORD ? (uint8_t *)text : entry_value(old);
+        uint8_t *front = prepend ? src : old_value;
+        uint8_t *back = prepend ? old_value : src;
+        size_t front_len = prepend ? n : old_len;
+        memcpy(entry_key(nv), key, key_len);
+        nv->flags = old->flags;
+        nv->exptime = old->exptime;
+        if (nv->chunked) {
+            vchunks_fill(nv, front, front_len);
+            vchunks_fill(nv, back, len - front_len);
+        } else {
+            memcpy(entry_value(nv), front, front_len);
+            memcpy(entry_value(nv) + front_len, back, len - front_len);
+        }
+        entry_check_counter(nv);
+        replace_entry(sh, old, nv);
+        cas = nv->cas;
+        pthread_mutex_unlock(&sh->lock);
+
+        epoch_retire(old, entry_retire);
+        break;
+    }
+
+    if (status != RES_OK) write_header(c, hdr, status, 0, 0, 0, 0);
+    else if (!is_quiet(hdr->opcode)) write_header(c, hdr, RES_OK, 0, 0, 0, cas);
 }
 
-void handle_get(int client_fd, memcache_req_header_t *hdr, uint8_t *key) {
-    uint16_t key_len = ntohs(hdr->key_length);
+int is_store(uint8_t opcode) {
+    return opcode == CMD_SET || opcode == CMD_SETQ || opcode == CMD_ADD || opcode == CMD_ADDQ;
+}
 
-    pthread_mutex_lock(&table_mutex);
-    cache_entry_t *entry = find_entry((char *)key, key_len);
-    if (entry) pthread_mutex_lock(&entry->lock);
-    pthread_mutex_unlock(&table_mutex);
+/* run a store once its entry is filled in */
+void process_store(conn_t *c, memcache_req_header_t *hdr, cache_entry_t *nv) {
+    entry_check_counter(nv);
+    if (hdr->opcode == CMD_SET || hdr->opcode == CMD_SETQ) handle_set(c, hdr, nv);
+    else handle_add(c, hdr, nv);
+}
 
-    memcache_req_header_t resp = {
-        .magic = 0x81,
-        .opcode = hdr->opcode,
-        .vbucket_id = htons(entry ? RES_OK : RES_NOT_FOUND),
-        .total_body_length = htonl(entry ? entry->value_len + key_len : 0),
-    };
+/* stores carry either no extras or the standard flags and exptime */
+int store_extras_ok(memcache_req_header_t *hdr) {
+    return hdr->extras_length == 0 || hdr->extras_length == 8;
+}
+
+/* a new entry for a store's key, given the extras, the key and the first
+ * avail bytes of the body
+ */
+cache_entry_t *store_entry(memcache_req_header_t *hdr, uint8_t *body, size_t avail) {
+    uint8_t extras_len = hdr->extras_length;
+    uint16_t key_len = ntohs(hdr->key_length);
+    uint32_t value_len = ntohl(hdr->total_body_length) - extras_len - key_len;
+    uint8_t *key = body + extras_len;
 
-    write(client_fd, &resp, sizeof(resp));
-    if (entry) {
-        write(client_fd, key, key_len);
-        write(client_fd, entry->value, entry->value_len);
-        pthread_mutex_unlock(&entry->lock);
+    uint32_t hv = key_hash(key, key_len);
+    cache_entry_t *nv = value_len > CHUNKED_MIN ? entry_alloc_chunked(hv, key_len, value_len)
+                                                : entry_alloc(hv, key_len, value_len);
+    if (!nv) return NULL;
+    size_t got = avail - extras_len;
+    memcpy(entry_key(nv), key, got < key_len ? got : key_len);
+    if (got > key_len) {
+        if (nv->chunked) vchunks_fill(nv, key + key_len, got - key_len);
+        else memcpy(entry_value(nv), key + key_len, got - key_len);
+    }
+    if (extras_len) {
+        uint32_t extras[2];
+        memcpy(extras, body, sizeof(extras));
+        nv->flags = ntohl(extras[0]);
+        nv->exptime = exptime_to_secs(ntohl(extras[1]));
     }
+    return nv;
 }
 
-void handle_set(int client_fd, memcache_req_header_t *hdr, uint8_t *key, uint8_t *value) {
+/* dispatch a single, fully buffered request frame */
+void process_request(conn_t *c, memcache_req_header_t *hdr, uint8_t *body) {
     uint16_t key_len = ntohs(hdr->key_length);
-    uint32_t total_len = ntohl(hdr->total_body_length);
-    uint32_t value_len = total_len - key_len;
 
-    pthread_mutex_lock(&table_mutex);
-    cache_entry_t *entry = find_entry((char *)key, key_len);
+    uint8_t *key = body + hdr->extras_length;
 
-    if (!entry) {
-        entry = malloc(sizeof(cache_entry_t));
-        entry->key = malloc(key_len);
-        memcpy(entry->key, key, key_len);
-        entry->key_len = key_len;
-        pthread_mutex_init(&entry->lock, NULL);
-        entry->value = NULL;
-        entry->value_len = 0;
-        HASH_ADD_KEYPTR(hh, cache_table, entry->key, key_len, entry);
+    if (is_store(hdr->opcode)) {
+        if (!store_extras_ok(hdr)) {
+            send_error_response(c, hdr);
+            return;
+        }
+        // small values are copied out of the read buffer into their entry
+        cache_entry_t *nv = store_entry(hdr, body, ntohl(hdr->total_body_length));
+        if (!nv) {
+            write_header(c, hdr, RES_ENOMEM, 0, 0, 0, 0);
+            return;
+        }
+        process_store(c, hdr, nv);
+        return;
     }
 
-    pthread_mutex_lock(&entry->lock);
-    pthread_mutex_unlock(&table_mutex);
+    switch (hdr->opcode) {
+        case CMD_GET:
+        case CMD_GETQ:    handle_get(c, hdr, key, 0); break;
+        case CMD_GETKQ:   handle_get(c, hdr, key, 1); break;
+        case CMD_DELETE:
+        case CMD_DELETEQ: handle_delete(c, hdr, key); break;
+        case CMD_INCREMENT:
+        case CMD_DECREMENT:
+        case CMD_INCREMENTQ:
+        case CMD_DECREMENTQ: handle_arith(c, hdr, body); break;
+        case CMD_APPEND:
+        case CMD_PREPEND:
+        case CMD_APPENDQ:
+        case CMD_PREPENDQ: handle_concat(c, hdr, body); break;
+        case CMD_FLUSH:
+        case CMD_FLUSHQ:  handle_flush(c, hdr, body); break;
+        case CMD_NOOP:    write_header(c, hdr, RES_OK, 0, 0, 0, 0); break;
+        case CMD_VERSION: handle_version(c, hdr); break;
+        case CMD_STAT:    handle_stat(c, hdr); break;
+        case CMD_OUTPUT:
+            // OUTPUT and GETK share an opcode; only GETK carries a key
+            if (key_len > 0) handle_get(c, hdr, key, 1);
+            else handle_output(c, hdr);
+            break;
+        default:          send_error_response(c, hdr); break;
+    }
+}
 
-    free(entry->value);
-    entry->value = malloc(value_len);
-    memcpy(entry->value, value, value_len);
-    entry->value_len = value_len;
+/* begin receiving a store's value straight into the entry it will be
+ * stored in, given the key and whatever part of the value has arrived.
+ * returns 0 if there is no memory for it; the frame is then buffered like
+ * any other and answered with an error.
+ */
+int conn_start_value(conn_t *c, memcache_req_header_t *hdr, uint8_t *body, size_t avail) {
+    c->nhdr = *hdr;
+    c->nvalue = store_entry(hdr, body, avail);
+    if (!c->nvalue) return 0;
+    c->nvalue_got = avail - hdr->extras_length - c->nvalue->key_len;
+    return 1;
+}
 
-    pthread_mutex_unlock(&entry->lock);
+/* is a value being received in place, or a rejected body thrown away? */
+static inline int conn_in_value(conn_t *c) {
+    return c->nvalue || c->nskip;
+}
 
-    memcache_req_header_t resp = {
-        .magic = 0x81,
-        .opcode = hdr->opcode,
-        .vbucket_id = htons(RES_OK),
-        .total_body_length = htonl(0),
-    };
-    write(client_fd, &resp, sizeof(resp));
+/* where the next bytes of the value being received go, and how many. a
+ * chunked value takes them a chunk at a time
+ */
+uint8_t *conn_value_dest(conn_t *c, size_t *len) {
+    static __thread uint8_t discard[RBUF_SIZE];
+    if (!c->nvalue) {
+        *len = c->nskip < sizeof(discard) ? c->nskip : sizeof(discard);
+        return discard;
+    }
+
+    *len = c->nvalue->len - c->nvalue_got;
+    if (!c->nvalue->chunked) return entry_value(c->nvalue) + c->nvalue_got;
+    size_t room;
+    uint8_t *dst = vchunks_dest(c->nvalue, &room);
+    if (*len > room) *len = room;
+    return dst;
 }
 
-void handle_add(int client_fd, memcache_req_header_t *hdr, uint8_t *key, uint8_t *value) {
-    uint16_t key_len = ntohs(hdr->key_length);
-    uint32_t total_len = ntohl(hdr->total_body_length);
-    uint32_t value_len = total_len - key_len;
-
-    pthread_mutex_lock(&table_mutex);
-    cache_entry_t *entry = find_entry((char *)key, key_len);
-
-    if (entry) {
-        pthread_mutex_unlock(&table_mutex);
-        memcache_req_header_t resp = {
-            .magic = 0x81,
-            .opcode = hdr->opcode,
-            .vbucket_id = htons(RES_EXISTS),
-            .total_body_length = htonl(0),
-        };
-        write(client_fd, &resp, sizeof(resp));
+/* account for received value bytes; runs the store once they're all in */
+void conn_value_received(conn_t *c, size_t n) {
+    if (!c->nvalue) {
+        c->nskip -= n;
         return;
     }
+    if (c->nvalue->chunked) entry_chunks(c->nvalue)->tail_used += n;
+    c->nvalue_got += n;
+    if (c->nvalue_got < c->nvalue->len) return;
 
-    entry = malloc(sizeof(cache_entry_t));
-    entry->key = malloc(key_len);
-    memcpy(entry->key, key, key_len);
-    entry->key_len = key_len;
-    pthread_mutex_init(&entry->lock, NULL);
-    entry->value = malloc(value_len);
-    memcpy(entry->value, value, value_len);
-    entry->value_len = value_len;
-    HASH_ADD_KEYPTR(hh, cache_table, entry->key, key_len, entry);
-    pthread_mutex_unlock(&table_mutex);
+    cache_entry_t *nv = c->nvalue;
+    c->nvalue = NULL;
+    process_store(c, &c->nhdr, nv);
+}
 
-    memcache_req_header_t resp = {
-        .magic = 0x81,
-        .opcode = hdr->opcode,
-        .vbucket_id = htons(RES_OK),
-        .total_body_length = htonl(0),
-    };
-    write(client_fd, &resp, sizeof(resp));
+void conn_drop_value(conn_t *c) {
+    entry_release(c->nvalue);
+    c->nvalue = NULL;
+    c->nskip = 0;
 }
 
-void handle_delete(int client_fd, memcache_req_header_t *hdr, uint8_t *key) {
-    uint16_t key_len = ntohs(hdr->key_length);
+/* parse and process every complete frame in buf. stops early once the
+ * pending output passes WBUF_HIGHWAT, leaving the rest for after the next
+ * flush so a deep pipeline can't buffer unbounded output. returns the
+ * number of bytes consumed, or -1 if the stream is corrupt and the
+ * connection should be dropped.
+ */
+ssize_t process_frames(conn_t *c, uint8_t *buf, size_t len) {
+    size_t off = 0;
 
-    pthread_mutex_lock(&table_mutex);
-    cache_entry_t *entry = find_entry((char *)key, key_len);
+    while (len - off >= sizeof(memcache_req_header_t)) {
+        if (c->state == CONN_CLOSE) return -1;
+        if (c->wbytes >= WBUF_HIGHWAT) break;
 
-    if (!entry) {
-        pthread_mutex_unlock(&table_mutex);
-        memcache_req_header_t resp = {
-            .magic = 0x81,
-            .opcode = hdr->opcode,
-            .vbucket_id = htons(RES_NOT_FOUND),
-            .total_body_length = htonl(0),
-        };
-        write(client_fd, &resp, sizeof(resp));
-        return;
+        memcache_req_header_t hdr;
+        memcpy(&hdr, buf + off, sizeof(hdr));
+
+        if (hdr.magic != 0x80) {
+            send_error_response(c, &hdr);
+            return -1;
+        }
+
+        size_t frame_len = sizeof(hdr) + ntohl(hdr.total_body_length);
+        if (hdr.extras_length + ntohs(hdr.key_length) > ntohl(hdr.total_body_length)) {
+            send_error_response(c, &hdr);
+            return -1;
+        }
+
+        // turn away values over the limit before buffering any of them
+        if (ntohl(hdr.total_body_length) - hdr.extras_length - ntohs(hdr.key_length) >
+            settings.item_max) {
+            write_header(c, &hdr, RES_E2BIG, 0, 0, 0, 0);
+            if (len - off < frame_len) {
+                c->nskip = frame_len - (len - off);
+                off = len;
+                break;
+            }
+            off += frame_len;
+            continue;
+        }
+
+        if (len - off < frame_len) {
+            // a store too big for the read buffer is received in place
+            if (frame_len > RBUF_SIZE && is_store(hdr.opcode) && store_extras_ok(&hdr) &&
+                len - off >= sizeof(hdr) + hdr.extras_length + ntohs(hdr.key_length)) {
+                if (conn_start_value(c, &hdr, buf + off + sizeof(hdr), len - off - sizeof(hdr)))
+                    off = len;
+            }
+            break;
+        }
+
+        process_request(c, &hdr, buf + off + sizeof(hdr));
+        off += frame_len;
+
+        // NOOP ends a batch of quiet commands; answer it before going on
+        if (hdr.opcode == CMD_NOOP) break;
     }
+    return c->state == CONN_CLOSE ? -1 : (ssize_t)off;
+}
 
-    pthread_mutex_lock(&entry->lock);
-    HASH_DEL(cache_table, entry);
-    pthread_mutex_unlock(&table_mutex);
+/* does rbuf start with a complete frame? */
+int conn_has_frame(conn_t *c) {
+    if (c->rbytes < sizeof(memcache_req_header_t)) return 0;
 
-    pthread_mutex_destroy(&entry->lock);
-    free(entry->key);
-    free(entry->value);
-    free(entry);
+    memcache_req_header_t hdr;
+    memcpy(&hdr, c->rbuf, sizeof(hdr));
+    return c->rbytes >= sizeof(hdr) + ntohl(hdr.total_body_length);
+}
 
-    memcache_req_header_t resp = {
-        .magic = 0x81,
-        .opcode = hdr->opcode,
-        .vbucket_id = htons(RES_OK),
-        .total_body_length = htonl(0),
-    };
-    write(client_fd, &resp, sizeof(resp));
+/* make sure rbuf can hold the whole of the partial frame at its front. of
+ * a store too big for it only the part up to the value is needed: once
+ * that is in, the value is received in place. all of it is buffered only
+ * if that could not start. room a finished frame needed is given back
+ */
+int conn_reserve_frame(conn_t *c) {
+    size_t need = c->rbytes > RBUF_SIZE ? c->rbytes : RBUF_SIZE;
+    if (c->rbytes >= sizeof(memcache_req_header_t)) {
+        memcache_req_header_t hdr;
+        memcpy(&hdr, c->rbuf, sizeof(hdr));
+        size_t frame_len = sizeof(hdr) + ntohl(hdr.total_body_length);
+        size_t head_len = sizeof(hdr) + hdr.extras_length + ntohs(hdr.key_length);
+        if (frame_len > RBUF_SIZE && is_store(hdr.opcode) && store_extras_ok(&hdr) &&
+            c->rbytes < head_len)
+            frame_len = head_len;
+        if (frame_len > need) need = frame_len;
+    }
+    if (need > c->rsize || (need == RBUF_SIZE && c->rsize > RBUF_SIZE)) {
+        uint8_t *nbuf = realloc(c->rbuf, need);
+        if (!nbuf) {
+            c->state = CONN_CLOSE;
+            return -1;
+        }
+        c->rbuf = nbuf;
+        c->rsize = need;
+    }
+    return 0;
 }
 
-void handle_version(int client_fd, memcache_req_header_t *req_hdr) {
-    const char *version = "C-Memcached 1.0";
-    size_t len = strlen(version);
+/* process the frames buffered in rbuf, keeping any partial frame */
+int process_buffer(conn_t *c) {
+    ssize_t off = process_frames(c, c->rbuf, c->rbytes);
+    if (off < 0) return -1;
 
-    memcache_req_header_t resp = {
-        .magic = 0x81,
-        .opcode = req_hdr->opcode,
-        .vbucket_id = htons(RES_OK),
-        .total_body_length = htonl(len)
+    // shift the partial frame (if any) to the front of the buffer
+    if (off > 0) {
+        memmove(c->rbuf, c->rbuf + off, c->rbytes - off);
+        c->rbytes -= off;
+    }
+    return conn_reserve_frame(c);
+}
+
+/* serve requests on a blocking connection until the peer closes it, then
+ * close it or park it
+ */
+void handle_client(worker_t *w, int client_fd) {
+    conn_t c = {
+        .fd = client_fd,
+        .io = IO_BLOCKING,
+        .state = CONN_READ,
+        .rbuf = malloc(RBUF_SIZE),
+        .rsize = RBUF_SIZE,
     };
+    if (!c.rbuf) {
+        close(client_fd);
+        return;
+    }
+
+    while (1) {
+        ssize_t n;
+        if (conn_in_value(&c)) {
+            size_t want;
+            uint8_t *dst = conn_value_dest(&c, &want);
+            n = recv(client_fd, dst, want, 0);
+        } else {
+            n = recv(client_fd, c.rbuf + c.rbytes, c.rsize - c.rbytes, 0);
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        if (conn_in_value(&c)) {
+            conn_value_received(&c, n);
+            if (conn_in_value(&c)) continue;
+        } else {
+            c.rbytes += n;
+        }
+
+        // one send for every response of the batch
+        int ok;
+        do {
+            ok = process_buffer(&c);
+            conn_flush(&c);
+        } while (ok == 0 && c.state != CONN_CLOSE && conn_has_frame(&c));
+        epoch_reclaim();
+        if (ok < 0 || c.state == CONN_CLOSE) break;
+    }
+
+    conn_drop_value(&c);
+    conn_release_output(&c);
+    free(c.rbuf);
+    free(c.wbuf);
+    if (c.nzc > 0) {
+        // without memory to park it the values stay referenced for good,
+        // which is still better than freed under the kernel
+        conn_t *parked = malloc(sizeof(*parked));
+        if (parked) {
+            *parked = c;
+            conn_park(w, parked);
+            return;
+        }
+    }
+    close(client_fd);
+}
+
+void *worker_thread(void *arg) {
+    worker_t *w = arg;
+    epoch_register();
+    my_stats = &worker_stats[w->id];
+    while (1) {
+        // look at parked connections every so often while none comes in
+        if (w->parked) {
+            reap_parked(w);
+            struct pollfd pfd = { .fd = w->listen_fd, .events = POLLIN };
+            if (w->parked && poll(&pfd, 1, TIMER_INTERVAL_MS) <= 0) continue;
+        }
+        struct sockaddr_in client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        int client_fd = accept(w->listen_fd, (struct sockaddr *)&client_addr, &addrlen);
+        if (client_fd < 0) continue;
+        conn_set_sockopts(client_fd);
+        handle_client(w, client_fd);
+    }
+    return NULL;
+}
 
-    write(client_fd, &resp, sizeof(resp));
-    write(client_fd, version, len);
+void conn_close(worker_t *w, conn_t *c) {
+    conn_drop_value(c);
+    conn_release_output(c);
+    if (c->rbuf && !w->spare_rbuf && c->rsize == RBUF_SIZE) w->spare_rbuf = c->rbuf;
+    else free(c->rbuf);
+    free(c->wbuf);
+    c->rbuf = c->wbuf = NULL;
+    if (conn_park(w, c)) {
+        // only the completions matter now; they arrive as EPOLLERR
+        struct epoll_event ev = { .events = EPOLLET, .data.ptr = c };
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
 }
 
-void handle_output(int client_fd, memcache_req_header_t *req_hdr) {
-    pthread_mutex_lock(&table_mutex);
+/* drive a non-blocking connection as far as it can go without blocking:
+ * flush the responses of the last batch, then read and process until the
+ * socket is empty or output backs up. returns -1 once the connection
+ * should close.
+ */
+int conn_drive(worker_t *w, conn_t *c) {
+    while (c->state != CONN_CLOSE) {
+        if (c->wbytes > 0) {
+            int r = conn_flush(c);
+            if (r <= 0) return r;
+        }
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+        // requests left over from before a backlog go first
+        if (conn_has_frame(c)) {
+            if (process_buffer(c) < 0) break;
+            continue;
+        }
+
+        // a large store's value goes straight into its own buffer
+        if (conn_in_value(c)) {
+            size_t want;
+            uint8_t *dst = conn_value_dest(c, &want);
+            ssize_t n = recv(c->fd, dst, want, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return -1;
+            }
+            if (n == 0) return -1;
+            conn_value_received(c, n);
+            continue;
+        }
 
-    cache_entry_t *entry, *tmp;
-    for (entry = cache_table; entry != NULL; entry = tmp) {
-        tmp = entry->hh.next;
+        // idle connections don't hold a read buffer; borrow the worker's
+        if (!c->rbuf) {
+            c->rbuf = w->spare_rbuf ? w->spare_rbuf : malloc(RBUF_SIZE);
+            w->spare_rbuf = NULL;
+            if (!c->rbuf) return -1;
+            c->rsize = RBUF_SIZE;
+        }
+
+        ssize_t n = recv(c->fd, c->rbuf + c->rbytes, c->rsize - c->rbytes, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (n == 0) return -1;
+        c->rbytes += n;
 
-        pthread_mutex_lock(&entry->lock);
-        printf("%08lx:%08lx:", ts.tv_sec, ts.tv_nsec);
-        for (size_t i = 0; i < entry->key_len; i++)
-            printf("%02x", (unsigned char)entry->key[i]);
-        printf(":");
-        for (size_t i = 0; i < entry->value_len; i++)
-            printf("%02x", ((unsigned char *)entry->value)[i]);
-        printf("\n");
-        pthread_mutex_unlock(&entry->lock);
+        if (process_buffer(c) < 0) break;
+    }
+    if (c->state == CONN_CLOSE || c->wbytes > 0) {
+        // best effort to get a final error response out
+        c->state = CONN_CLOSE;
+        conn_flush(c);
+        return -1;
     }
 
-    pthread_mutex_unlock(&table_mutex);
+    // give the read buffer back once nothing is pending in it
+    if (c->rbytes == 0 && c->rbuf) {
+        if (!w->spare_rbuf && c->rsize == RBUF_SIZE) w->spare_rbuf = c->rbuf;
+        else free(c->rbuf);
+        c->rbuf = NULL;
+        c->rsize = 0;
+    }
+    return 0;
+}
 
-    memcache_req_header_t resp = {
-        .magic = 0x81,
-        .opcode = req_hdr->opcode,
-        .vbucket_id = htons(RES_OK),
-        .total_body_length = htonl(0)
-    };
+void accept_connections(worker_t *w) {
+    while (1) {
+        int fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            // EAGAIN: another worker got there first, or the queue is empty
+            return;
+        }
+
+        conn_t *c = calloc(1, sizeof(conn_t));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        conn_set_sockopts(fd);
+        c->fd = fd;
+        c->io = IO_EPOLL;
+        c->state = CONN_READ;
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+/* event loop of one worker: every connection it accepted is edge-triggered
+ * on both directions, so a single registration covers the read and write
+ * states of the connection state machine.
+ */
+void *event_worker_thread(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    epoch_register();
+    my_stats = &worker_stats[w->id];
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
 
-    write(client_fd, &resp, sizeof(resp));
+    // with a shared listener every worker watches it and EPOLLEXCLUSIVE
+    // wakes only one of them
+    struct epoll_event lev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listen_fd, &lev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        // parked connections are looked at once their completions wake
+        // us, and every so often in case those were missed
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, w->parked ? TIMER_INTERVAL_MS : -1);
+        for (int i = 0; i < n; i++) {
+            conn_t *c = events[i].data.ptr;
+            if (!c) {
+                accept_connections(w);
+                continue;
+            }
+            if (c->parked) continue;
+            // zerocopy completions are reported as EPOLLERR too
+            if ((events[i].events & EPOLLERR) && c->nzc > 0) {
+                conn_reap_zerocopy(c);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(w, c);
+                continue;
+            }
+            if (conn_drive(w, c) < 0) conn_close(w, c);
+        }
+        if (w->parked) reap_parked(w);
+        epoch_reclaim();
+    }
+    return NULL;
 }
 
-void send_error_response(int client_fd, uint8_t opcode) {
-    memcache_req_header_t resp = {
-        .magic = 0x81,
-        .opcode = opcode,
-        .vbucket_id = htons(RES_ERROR),
-        .total_body_length = htonl(0),
+/* io_uring engine, driven through the raw system calls.
+ *
+ * every worker owns a ring. a multishot accept on the listener produces
+ * connections; each one gets a multishot recv that picks its buffers from a
+ * provided buffer ring, so idle connections pin no memory. frames are parsed
+ * straight out of the provided buffer and only a trailing partial frame is
+ * copied into the connection. responses accumulate in wbuf and go out as one
+ * send per connection per completion batch; when a connection has to go
+ * away after its last response, that send is linked to a shutdown.
+ * submissions and waiting share a single io_uring_enter per loop.
+ */
+#define URING_ENTRIES 4096
+#define URING_BUFS 256 // provided buffers per worker, RBUF_SIZE each
+#define URING_BGID 0
+
+#define URING_RBUF_MAX (4 * RBUF_SIZE) // held back frames that pause the recv
+
+enum uring_op {
+    UD_ACCEPT,
+    UD_RECV,
+    UD_SEND,
+    UD_SHUTDOWN,
+    UD_CANCEL,
+};
+
+typedef struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    struct io_uring_buf_ring *br;
+    uint8_t *bufs;
+    unsigned br_tail;
+    void *sq_map, *cq_map;  // for uring_free
+    size_t sq_len, cq_len;
+} uring_t;
+
+// connections are malloc'd, so the low 3 bits of their address are free
+#define UD_PACK(c, op) ((uint64_t)(uintptr_t)(c) | (op))
+#define UD_CONN(ud) ((conn_t *)(uintptr_t)((ud) & ~(uint64_t)7))
+#define UD_OP(ud) ((int)((ud) & 7))
+
+int uring_enter(uring_t *r, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(uring_t *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        // kernels before 6.1 don't know the task-run flags
+        memset(&p, 0, sizeof(p));
+        r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (r->fd < 0) return -1;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_len > sq_len) sq_len = cq_len;
+        cq_len = sq_len;
+    }
+
+    uint8_t *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -1;
+    uint8_t *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return -1;
+    }
+    r->sq_map = sq;
+    r->sq_len = sq_len;
+    r->cq_map = cq;
+    r->cq_len = cq_len;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) return -1;
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+
+    // provided buffer ring for recv
+    size_t br_len = URING_BUFS * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) return -1;
+    r->bufs = malloc((size_t)URING_BUFS * RBUF_SIZE);
+    if (!r->bufs) return -1;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)r->br,
+        .ring_entries = URING_BUFS,
+        .bgid = URING_BGID,
     };
-    write(client_fd, &resp, sizeof(resp));
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    for (unsigned i = 0; i < URING_BUFS; i++) {
+        struct io_uring_buf *b = &r->br->bufs[i];
+        b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)i * RBUF_SIZE);
+        b->len = RBUF_SIZE;
+        b->bid = i;
+    }
+    r->br_tail = URING_BUFS;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+    return 0;
 }
 
-void handle_client(int client_fd) {
-    memcache_req_header_t hdr;
-    ssize_t n = recv(client_fd, &hdr, sizeof(hdr), MSG_WAITALL);
+/* undo a uring_init that succeeded */
+void uring_free(uring_t *r) {
+    munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+    free(r->bufs);
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_len);
+    munmap(r->sq_map, r->sq_len);
+    close(r->fd);
+}
+
+/* hand a consumed buffer back to the kernel */
+void uring_recycle_buf(uring_t *r, unsigned bid) {
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * RBUF_SIZE);
+    b->len = RBUF_SIZE;
+    b->bid = bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        // ring full; push what we have to the kernel first
+        uring_enter(r, r->to_submit, 0, 0);
+        r->to_submit = 0;
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries) return NULL;
+    }
+
+    unsigned idx = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+void uring_arm_accept(uring_t *r, int listen_fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = UD_PACK(NULL, UD_ACCEPT);
+}
+
+void uring_arm_recv(uring_t *r, conn_t *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe) {
+        c->state = CONN_CLOSE;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UD_PACK(c, UD_RECV);
+    c->recv_armed = 1;
+    c->inflight++;
+}
+
+/* a client that pipelines without reading its responses leaves frames
+ * held back (by WBUF_HIGHWAT or a NOOP) in rbuf. the multishot recv keeps
+ * reading regardless, so once they pass URING_RBUF_MAX cancel it, and arm
+ * it again when the flush has let them run.
+ */
+void uring_update_recv(uring_t *r, conn_t *c) {
+    if (c->state == CONN_CLOSE) return;
+    c->recv_paused = c->rbytes >= URING_RBUF_MAX && conn_has_frame(c);
+    if (!c->recv_paused) {
+        if (!c->recv_armed) uring_arm_recv(r, c);
+        return;
+    }
+    if (!c->recv_armed || c->recv_cancel) return;
 
-    if (n != sizeof(hdr) || hdr.magic != 0x80) {
-        send_error_response(client_fd, hdr.opcode);
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (!sqe) {
+        c->state = CONN_CLOSE;
         return;
     }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = UD_PACK(c, UD_RECV);
+    sqe->user_data = UD_PACK(c, UD_CANCEL);
+    c->recv_cancel = 1;
+    c->inflight++;
+}
+
+/* send whatever the connection has queued. only one send is in flight per
+ * connection, so the byte stream can't be reordered. if the connection is
+ * closing, link a shutdown behind the send so the final response still goes
+ * out before the recv is torn down.
+ */
+void uring_flush(uring_t *r, conn_t *c) {
+    if (c->sbytes > 0 || c->shutdown_sent) return;
 
-    uint32_t total_len = ntohl(hdr.total_body_length);
-    uint16_t key_len   = ntohs(hdr.key_length);
+    int closing = c->state == CONN_CLOSE;
+    if (c->wbytes > 0) {
+        // swap the pending output into the in-flight slot
+        uint8_t *buf = c->sbuf;
+        size_t size = c->ssize;
+        c->sbuf = c->wbuf;
+        c->ssize = c->wsize;
+        c->sbytes = c->wbytes;
+        c->scurr = 0;
+        c->wbuf = buf;
+        c->wsize = size;
+        c->wbytes = c->wcurr = 0;
 
-    uint8_t *body = NULL;
-    if (total_len > 0) {
-        body = malloc(total_len);
-        ssize_t body_read = recv(client_fd, body, total_len, MSG_WAITALL);
-        if (body_read != total_len) {
-            free(body);
+        struct io_uring_sqe *sqe = uring_get_sqe(r);
+        if (!sqe) {
+            c->state = CONN_CLOSE;
+            shutdown(c->fd, SHUT_RDWR);
             return;
         }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (uint64_t)(uintptr_t)c->sbuf;
+        sqe->len = c->sbytes;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = UD_PACK(c, UD_SEND);
+        if (closing) sqe->flags |= IOSQE_IO_LINK;
+        c->inflight++;
     }
 
-    uint8_t *key = body;
-    uint8_t *value = (key_len > 0) ? (body + key_len) : NULL;
+    if (closing && !c->shutdown_sent) {
+        c->shutdown_sent = 1;
+        struct io_uring_sqe *sqe = uring_get_sqe(r);
+        if (!sqe) {
+            shutdown(c->fd, SHUT_RDWR);
+            return;
+        }
+        sqe->opcode = IORING_OP_SHUTDOWN;
+        sqe->fd = c->fd;
+        sqe->len = SHUT_RDWR;
+        sqe->user_data = UD_PACK(c, UD_SHUTDOWN);
+        c->inflight++;
+    }
+}
+
+void uring_mark_dirty(conn_t *c, conn_t **dirty) {
+    if (c->dirty) return;
+    c->dirty = 1;
+    c->next_dirty = *dirty;
+    *dirty = c;
+}
+
+void uring_conn_free(worker_t *w, conn_t *c) {
+    conn_drop_value(c);
+    conn_release_output(c);
+    close(c->fd);
+    if (c->rbuf && !w->spare_rbuf && c->rsize == RBUF_SIZE) w->spare_rbuf = c->rbuf;
+    else free(c->rbuf);
+    free(c->wbuf);
+    free(c->sbuf);
+    free(c);
+}
+
+/* feed received bytes to the connection. frames are parsed in place when
+ * nothing is pending from an earlier recv, and a large store's value is
+ * copied straight into its own buffer.
+ */
+int uring_consume(worker_t *w, conn_t *c, uint8_t *data, size_t len) {
+    while (len > 0) {
+        if (conn_in_value(c)) {
+            size_t want;
+            uint8_t *dst = conn_value_dest(c, &want);
+            size_t n = len < want ? len : want;
+            memcpy(dst, data, n);
+            data += n;
+            len -= n;
+            conn_value_received(c, n);
+            if (c->state == CONN_CLOSE) return -1;
+            continue;
+        }
+
+        if (c->rbytes == 0) {
+            ssize_t off = process_frames(c, data, len);
+            if (off < 0) return -1;
+            data += off;
+            len -= off;
+            if (len == 0 || conn_in_value(c)) continue;
+        }
+
+        if (!c->rbuf) {
+            c->rbuf = w->spare_rbuf ? w->spare_rbuf : malloc(RBUF_SIZE);
+            w->spare_rbuf = NULL;
+            if (!c->rbuf) return -1;
+            c->rsize = RBUF_SIZE;
+        }
 
-    switch (hdr.opcode) {
-        case CMD_GET:     handle_get(client_fd, &hdr, key); break;
-        case CMD_SET:     handle_set(client_fd, &hdr, key, value); break;
-        case CMD_ADD:     handle_add(client_fd, &hdr, key, value); break;
-        case CMD_DELETE:  handle_delete(client_fd, &hdr, key); break;
-        case CMD_VERSION: handle_version(client_fd, &hdr); break;
-        case CMD_OUTPUT:  handle_output(client_fd, &hdr); break;
-        default:          send_error_response(client_fd, hdr.opcode); break;
+        size_t room = c->rsize - c->rbytes;
+        if (room == 0) {
+            // parsing is held back (NOOP or WBUF_HIGHWAT); keep the bytes
+            uint8_t *nbuf = realloc(c->rbuf, c->rsize * 2);
+            if (!nbuf) return -1;
+            c->rbuf = nbuf;
+            c->rsize *= 2;
+            continue;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(c->rbuf + c->rbytes, data, n);
+        c->rbytes += n;
+        data += n;
+        len -= n;
+        if (process_buffer(c) < 0) return -1;
     }
 
-    if (body) free(body);
+    if (c->rbytes == 0 && c->rbuf) {
+        if (!w->spare_rbuf && c->rsize == RBUF_SIZE) w->spare_rbuf = c->rbuf;
+        else free(c->rbuf);
+        c->rbuf = NULL;
+        c->rsize = 0;
+    }
+    return 0;
 }
 
-void *worker_thread(void *arg) {
+void uring_handle_cqe(worker_t *w, struct io_uring_cqe *cqe, conn_t **dirty) {
+    uring_t *r = w->ring;
+    conn_t *c = UD_CONN(cqe->user_data);
+
+    switch (UD_OP(cqe->user_data)) {
+    case UD_ACCEPT:
+        if (!(cqe->flags & IORING_CQE_F_MORE)) uring_arm_accept(r, w->listen_fd);
+        if (cqe->res < 0) return;
+
+        c = calloc(1, sizeof(conn_t));
+        if (!c) {
+            close(cqe->res);
+            return;
+        }
+        conn_set_sockopts(cqe->res);
+        c->fd = cqe->res;
+        c->io = IO_URING;
+        c->state = CONN_READ;
+        uring_arm_recv(r, c);
+        return;
+
+    case UD_RECV:
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            c->recv_armed = 0;
+            c->recv_cancel = 0;
+            c->inflight--;
+        }
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (c->state != CONN_CLOSE &&
+                uring_consume(w, c, r->bufs + (size_t)bid * RBUF_SIZE, cqe->res) < 0)
+                c->state = CONN_CLOSE;
+            uring_recycle_buf(r, bid);
+        } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            // EOF or a socket error
+            c->state = CONN_CLOSE;
+        }
+        // bytes the recv had already taken when cancelled are kept
+        uring_update_recv(r, c);
+        break;
+
+    case UD_SEND:
+        c->inflight--;
+        if (cqe->res < 0) {
+            c->state = CONN_CLOSE;
+            c->sbytes = 0;
+            break;
+        }
+        c->scurr += cqe->res;
+        if (c->scurr < c->sbytes && c->state != CONN_CLOSE) {
+            // short send; push the remainder before anything else
+            struct io_uring_sqe *sqe = uring_get_sqe(r);
+            if (sqe) {
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = c->fd;
+                sqe->addr = (uint64_t)(uintptr_t)(c->sbuf + c->scurr);
+                sqe->len = c->sbytes - c->scurr;
+                sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+                sqe->user_data = UD_PACK(c, UD_SEND);
+                c->inflight++;
+                return;
+            }
+            c->state = CONN_CLOSE;
+        }
+        c->sbytes = c->scurr = 0;
+        // requests held back by WBUF_HIGHWAT can run now
+        if (c->state != CONN_CLOSE && conn_has_frame(c) && process_buffer(c) < 0)
+            c->state = CONN_CLOSE;
+        uring_update_recv(r, c);
+        break;
+
+    case UD_SHUTDOWN:
+    case UD_CANCEL:
+        c->inflight--;
+        break;
+    }
+
+    uring_mark_dirty(c, dirty);
+}
+
+/* multishot recv, which the engine is built on, came with Linux 6.0:
+ * older kernels fail it with EINVAL. try one on a socketpair
+ */
+int uring_supported(void) {
+    uring_t r = {0};
+    if (uring_init(&r) < 0) return 0;
+
+    int ok = 0, sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+        conn_t c = { .fd = sv[0] };
+        uring_arm_recv(&r, &c);
+        if (send(sv[1], "", 1, 0) == 1 &&
+            uring_enter(&r, r.to_submit, 1, IORING_ENTER_GETEVENTS) >= 0) {
+            struct io_uring_cqe *cqe = &r.cqes[*r.cq_head & *r.cq_mask];
+            ok = cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE);
+        }
+        close(sv[0]);
+        close(sv[1]);
+    }
+    uring_free(&r);
+    return ok;
+}
+
+void *uring_worker_thread(void *arg) {
+    worker_t *w = arg;
+    uring_t ring = {0};
+    w->ring = &ring;
+    epoch_register();
+    my_stats = &worker_stats[w->id];
+
+    if (uring_init(&ring) < 0) {
+        perror("io_uring");
+        exit(EXIT_FAILURE);
+    }
+    uring_arm_accept(&ring, w->listen_fd);
+
     while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t addrlen = sizeof(client_addr);
-        int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addrlen);
-        if (client_fd < 0) continue;
-        handle_client(client_fd);
-        close(client_fd);
+        int ret = uring_enter(&ring, ring.to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (ret >= 0) ring.to_submit -= ret < (int)ring.to_submit ? (unsigned)ret : ring.to_submit;
+        else if (errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        conn_t *dirty = NULL;
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+            uring_handle_cqe(w, &ring.cqes[head & *ring.cq_mask], &dirty);
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // one send per connection per batch; free connections that are done
+        while (dirty) {
+            conn_t *c = dirty;
+            dirty = c->next_dirty;
+            c->dirty = 0;
+
+            if (c->state == CONN_CLOSE && c->inflight == 0 && c->sbytes == 0) {
+                uring_conn_free(w, c);
+                continue;
+            }
+            uring_flush(&ring, c);
+        }
+        epoch_reclaim();
     }
     return NULL;
 }
 
-int setup_server_socket(int port) {
+/* create a listening socket. with reuseport set, several of them can share
+ * the port and the kernel spreads incoming connections across their
+ * separate accept queues; cpu >= 0 prefers connections handled on that CPU.
+ */
+int setup_server_socket(int port, int reuseport, int cpu) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) {
         perror("socket");
@@ -292,6 +4192,12 @@ int setup_server_socket(int port) {
 
     int opt = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+    if (reuseport && cpu >= 0)
+        setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
 
     struct sockaddr_in addr = {
         .sin_family = AF_INET,
@@ -304,7 +4210,7 @@ int setup_server_socket(int port) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(sock, BACKLOG) < 0) {
+    if (listen(sock, settings.backlog) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
@@ -312,30 +4218,172 @@ int setup_server_socket(int port) {
     return sock;
 }
 
+void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options] <port> <num_threads>\n"
+        "  -i <model>   I/O model: blocking (default), epoll or uring\n"
+        "  -b <n>       listen backlog (default %d)\n"
+        "  -R           give every worker its own SO_REUSEPORT listener (epoll or uring)\n"
+        "  -c           pin every worker thread to its own CPU\n"
+        "  -z <bytes>   send values this big with MSG_ZEROCOPY, 0 to disable (default %d)\n"
+        "  -s <n>       number of table shards, a power of two up to %d (default %d)\n"
+        "  -x <index>   table index: chain (default) or swiss\n"
+        "  -m <mb>      evict items past this much memory\n"
+        "  -e <policy>  eviction policy: lru (default), clock, s3fifo or tinylfu\n"
+        "  -I <bytes>   largest value stored (default %d)\n"
+        "  -H <n>       private copies of hot items per worker, up to %d, 0 to disable (default %d)\n"
+        "  -N           place shards' memory and workers on NUMA nodes\n",
+        prog, BACKLOG, ZEROCOPY_MIN, MAX_SHARDS, NUM_SHARDS, ITEM_MAX, MAX_HOT_COPIES, HOT_COPIES);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <port> <num_threads>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    int opt;
+    while ((opt = getopt(argc, argv, "i:b:Rcz:s:x:m:e:I:H:N")) != -1) {
+        switch (opt) {
+            case 'i':
+                if (strcmp(optarg, "blocking") == 0) settings.io_model = IO_BLOCKING;
+                else if (strcmp(optarg, "epoll") == 0) settings.io_model = IO_EPOLL;
+                else if (strcmp(optarg, "uring") == 0) settings.io_model = IO_URING;
+                else usage(argv[0]);
+                break;
+            case 'b':
+                settings.backlog = atoi(optarg);
+                if (settings.backlog <= 0) usage(argv[0]);
+                break;
+            case 'R':
+                settings.reuseport = 1;
+                break;
+            case 'c':
+                settings.pin_cpus = 1;
+                break;
+            case 'N':
+                settings.numa = 1;
+                break;
+            case 'z':
+                settings.zerocopy_min = strtoul(optarg, NULL, 10);
+                break;
+            case 'I':
+                settings.item_max = strtoul(optarg, NULL, 10);
+                if (settings.item_max == 0 || settings.item_max > UINT32_MAX) usage(argv[0]);
+                break;
+            case 'H':
+                settings.hot_copies = strtoul(optarg, NULL, 10);
+                if (settings.hot_copies > MAX_HOT_COPIES) usage(argv[0]);
+                break;
+            case 's':
+                settings.num_shards = strtoul(optarg, NULL, 10);
+                if (settings.num_shards == 0 || settings.num_shards > MAX_SHARDS ||
+                    (settings.num_shards & (settings.num_shards - 1)))
+                    usage(argv[0]);
+                break;
+            case 'm':
+                settings.mem_limit = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'e': {
+                size_t n = sizeof(evict_policies) / sizeof(evict_policies[0]);
+                size_t i = 0;
+                while (i < n && strcmp(optarg, evict_policies[i].name) != 0) i++;
+                if (i == n) usage(argv[0]);
+                settings.evict = i;
+                break;
+            }
+            case 'x':
+                if (strcmp(optarg, "chain") == 0) settings.index = INDEX_CHAIN;
+                else if (strcmp(optarg, "swiss") == 0) settings.index = INDEX_SWISS;
+                else usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
+    if (argc - optind != 2) usage(argv[0]);
+    // a blocking worker serves one connection at a time, so the others
+    // the kernel queued on its listener would wait for it to close
+    if (settings.reuseport && settings.io_model == IO_BLOCKING) usage(argv[0]);
 
-    int port = atoi(argv[1]);
-    int num_threads = atoi(argv[2]);
-    if (num_threads <= 0 || num_threads > MAX_THREADS) {
+    settings.port = atoi(argv[optind]);
+    settings.num_threads = atoi(argv[optind + 1]);
+    if (settings.num_threads <= 0 || settings.num_threads > MAX_THREADS) {
         fprintf(stderr, "Invalid thread count. Max is %d.\n", MAX_THREADS);
         exit(EXIT_FAILURE);
     }
 
-    server_fd = setup_server_socket(port);
+    if (settings.io_model == IO_URING && !uring_supported()) {
+        fprintf(stderr, "-i uring needs io_uring with multishot recv, Linux 6.0 or newer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cpu_set_t allowed;
+    if ((settings.pin_cpus || settings.numa) &&
+        sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        exit(EXIT_FAILURE);
+    }
+    if (settings.numa) numa_init(&allowed);
+
+    slabs_init();
+    shards_init(settings.num_shards);
+    evict_init();
+
+    pthread_t timer;
+    pthread_create(&timer, NULL, timer_thread, NULL);
+
+    // CPUs we are allowed to run on, in order, for pinning workers; with
+    // -N those of each node
+    int cpus[MAX_NODES][CPU_SETSIZE];
+    int num_cpus[MAX_NODES] = {0};
+    if (settings.pin_cpus) {
+        for (unsigned node = 0; node < num_nodes; node++)
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (settings.numa ? CPU_ISSET(cpu, &node_cpus[node]) : CPU_ISSET(cpu, &allowed))
+                    cpus[node][num_cpus[node]++] = cpu;
+    }
+
+    if (!settings.reuseport) server_fd = setup_server_socket(settings.port, 0, -1);
+
+    // workers take the nodes in turn, so each node's CPUs get their share
+    worker_t workers[MAX_THREADS];
+    for (int i = 0; i < settings.num_threads; i++) {
+        worker_t *w = &workers[i];
+        *w = (worker_t){ .id = i, .cpu = -1, .epfd = -1, .listen_fd = server_fd };
+        w->node = i % num_nodes;
+        worker_stats[i].node = w->node;
+        unsigned nth = i / num_nodes;
+        if (num_cpus[w->node] > 0) w->cpu = cpus[w->node][nth % num_cpus[w->node]];
+        if (settings.reuseport) w->listen_fd = setup_server_socket(settings.port, 1, w->cpu);
+    }
+
+    for (int i = 0; i < settings.num_threads; i++) {
+        worker_t *w = &workers[i];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (w->cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        } else if (settings.numa) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &node_cpus[w->node]);
+        }
 
-    pthread_t threads[MAX_THREADS];
-    for (int i = 0; i < num_threads; i++) {
-        pthread_create(&threads[i], NULL, worker_thread, NULL);
+        if (settings.io_model == IO_EPOLL) {
+            int flags = fcntl(w->listen_fd, F_GETFL);
+            fcntl(w->listen_fd, F_SETFL, flags | O_NONBLOCK);
+            pthread_create(&w->thread, &attr, event_worker_thread, w);
+        } else if (settings.io_model == IO_URING) {
+            pthread_create(&w->thread, &attr, uring_worker_thread, w);
+        } else {
+            pthread_create(&w->thread, &attr, worker_thread, w);
+        }
+        pthread_attr_destroy(&attr);
     }
 
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    for (int i = 0; i < settings.num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (settings.reuseport) close(workers[i].listen_fd);
     }
 
-    close(server_fd);
+    if (!settings.reuseport) close(server_fd);
     return 0;
 }
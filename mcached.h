@@ -9,12 +9,34 @@
 #define CMD_SET     0x01
 #define CMD_ADD     0x02
 #define CMD_DELETE  0x04
+#define CMD_INCREMENT 0x05
+#define CMD_DECREMENT 0x06
+#define CMD_FLUSH   0x08
+#define CMD_GETQ    0x09
+#define CMD_NOOP    0x0a
 #define CMD_VERSION 0x0b
-#define CMD_OUTPUT  0x0c
+#define CMD_OUTPUT  0x0c // without a key; with one it is GETK
+#define CMD_GETK    0x0c
+#define CMD_GETKQ   0x0d
+#define CMD_APPEND  0x0e
+#define CMD_PREPEND 0x0f
+#define CMD_STAT    0x10
+#define CMD_SETQ    0x11
+#define CMD_ADDQ    0x12
+#define CMD_DELETEQ 0x14
+#define CMD_INCREMENTQ 0x15
+#define CMD_DECREMENTQ 0x16
+#define CMD_FLUSHQ  0x18
+#define CMD_APPENDQ 0x19
+#define CMD_PREPENDQ 0x1a
 #define RES_OK         0x0000
 #define RES_NOT_FOUND  0x0001
 #define RES_EXISTS     0x0002
+#define RES_E2BIG      0x0003
 #define RES_ERROR      0x0004
+#define RES_NOT_STORED 0x0005
+#define RES_DELTA_BADVAL 0x0006 // INCREMENT/DECREMENT on a non-counter
+#define RES_ENOMEM     0x0082
 
 /* struct for memcached request header */
 typedef struct {